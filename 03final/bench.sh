@@ -0,0 +1,60 @@
+#!/bin/bash
+# end-to-end benchmark of the master and workers over loopback
+#
+# Starts WORKERS workers on ports PORT, PORT+1, ..., generates a corpus of
+# SIZE bytes unless CORPUS is given, and runs the master once for every
+# counting mode, scheduling mode and data shipping setting. Every run
+# appends one json line to OUT, see write_report in server.c.
+#
+#   make bench WORKERS=4 SIZE=1G
+#   WORKERS=2 SIZE=256M OUT=before.jsonl ./bench.sh
+
+WORKERS=${WORKERS:-4}
+SIZE=${SIZE:-256M}
+PORT=${PORT:-21000}
+THREADS=${THREADS:-1}
+CHUNK=${CHUNK:-16M}
+OUT=${OUT:-bench.jsonl}
+CORPUS=${CORPUS:-}
+COUNTS=${COUNTS:-"letters words"}
+MODES=${MODES:-"static dynamic"}
+
+cd "$(dirname "$0")"
+
+if [ -z "$CORPUS" ]; then
+	CORPUS=bench_corpus_$SIZE.txt
+	[ -f "$CORPUS" ] || ./gencorpus -s "$SIZE" "$CORPUS" || exit 1
+fi
+CORPUS=$(realpath "$CORPUS")
+
+conf=$(mktemp)
+for ((i = 0; i < WORKERS; i++)); do
+	echo "127.0.0.1:$((PORT + i))" >> "$conf"
+done
+
+# the workers are started once and serve every run, as a fleet shared by
+# many jobs would; their result cache is off so that no run is answered
+# from the one before
+pids=""
+for ((i = 0; i < WORKERS; i++)); do
+	./client -p $((PORT + i)) -t "$THREADS" -C 0 > /dev/null 2>&1 &
+	pids="$pids $!"
+done
+trap 'rm -f "$conf"; kill $pids 2> /dev/null; wait $pids 2> /dev/null || true' EXIT
+sleep 0.2
+
+run() {
+	./server -c "$conf" -J "$OUT" "$@" "$CORPUS" > /dev/null
+}
+
+for count in $COUNTS; do
+	for mode in $MODES; do
+		for ship in "" "-d"; do
+			args="-m $mode -s $CHUNK $ship"
+			[ "$count" = words ] && args="$args -w"
+			echo "== $count $args" >&2
+			run $args || echo "run failed: $count $args" >&2
+			tail -n 1 "$OUT"
+		done
+	done
+done
@@ -0,0 +1,332 @@
+/* worker side cache of letter histograms */
+
+#include "cache.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define CACHE_MAGIC 0x4c434348		// "LCCH"
+#define CACHE_VERSION 1
+
+#define CACHE_NONE UINT32_MAX
+
+// what a cached histogram was counted from
+struct cache_key {
+	uint64_t dev, ino, mtime_ns, size;
+	uint64_t start, end;
+};
+
+// entries are linked by index, so the cache file can be mapped anywhere
+struct cache_entry {
+	struct cache_key key;
+	uint64_t counter[NLETTERS];
+	uint32_t prev, next;		// LRU list, most recently used first
+	uint32_t hnext;				// hash chain
+	uint32_t valid;
+};
+
+// layout of the cache, in memory or in the cache file
+struct cache_file {
+	uint32_t magic, version;
+	uint32_t nentries, pad;
+	uint64_t grid;
+	uint32_t lru_head, lru_tail;
+	struct cache_entry entries[];
+};
+
+static struct {
+	struct cache_file *file;
+	size_t map_len;
+	uint32_t *buckets;			// rebuilt when the cache is opened
+	uint32_t nbuckets;
+	uint64_t hits;
+} cache;
+
+// the entries are shared by the threads serving jobs, files are counted
+// without it
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint32_t key_hash(const struct cache_key *k)
+{
+	const uint64_t *w = (const uint64_t *)k;
+	uint64_t h = 0;
+	for (size_t i = 0; i < sizeof(*k) / sizeof(uint64_t); i++)
+		h = (h ^ w[i]) * 0x9e3779b97f4a7c15ULL;
+	return (h >> 32) & (cache.nbuckets - 1);
+}
+
+static void lru_unlink(uint32_t i)
+{
+	struct cache_file *f = cache.file;
+	struct cache_entry *e = &f->entries[i];
+	if (e->prev != CACHE_NONE)
+		f->entries[e->prev].next = e->next;
+	else
+		f->lru_head = e->next;
+	if (e->next != CACHE_NONE)
+		f->entries[e->next].prev = e->prev;
+	else
+		f->lru_tail = e->prev;
+}
+
+static void lru_push_front(uint32_t i)
+{
+	struct cache_file *f = cache.file;
+	struct cache_entry *e = &f->entries[i];
+	e->prev = CACHE_NONE;
+	e->next = f->lru_head;
+	if (f->lru_head != CACHE_NONE)
+		f->entries[f->lru_head].prev = i;
+	else
+		f->lru_tail = i;
+	f->lru_head = i;
+}
+
+static void hash_insert(uint32_t i)
+{
+	struct cache_entry *e = &cache.file->entries[i];
+	uint32_t b = key_hash(&e->key);
+	e->hnext = cache.buckets[b];
+	cache.buckets[b] = i;
+}
+
+static void hash_remove(uint32_t i)
+{
+	struct cache_entry *entries = cache.file->entries;
+	uint32_t *p = &cache.buckets[key_hash(&entries[i].key)];
+	while (*p != CACHE_NONE && *p != i)
+		p = &entries[*p].hnext;
+	if (*p == i)
+		*p = entries[i].hnext;
+}
+
+// an empty cache, every entry in the LRU list
+static void cache_reset(uint32_t nentries, uint64_t grid)
+{
+	struct cache_file *f = cache.file;
+	memset(f, 0, sizeof(struct cache_file) + nentries * sizeof(struct cache_entry));
+	f->magic = CACHE_MAGIC;
+	f->version = CACHE_VERSION;
+	f->nentries = nentries;
+	f->grid = grid;
+	f->lru_head = f->lru_tail = CACHE_NONE;
+	for (uint32_t i = 0; i < nentries; i++)
+		lru_push_front(i);
+}
+
+int cache_open(const char *path, uint32_t nentries, uint64_t grid)
+{
+	if (nentries == 0 || grid == 0)
+		return -1;
+
+	size_t len = sizeof(struct cache_file) + nentries * sizeof(struct cache_entry);
+	int fd = -1;
+	if (path) {
+		fd = open(path, O_RDWR | O_CREAT, 0644);
+		if (fd < 0 || ftruncate(fd, len) < 0) {
+			if (fd >= 0)
+				close(fd);
+			return -1;
+		}
+	}
+
+	void *p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+			path ? MAP_SHARED : MAP_PRIVATE | MAP_ANONYMOUS, fd, 0);
+	if (fd >= 0)
+		close(fd);
+	if (p == MAP_FAILED)
+		return -1;
+
+	cache.nbuckets = 1;
+	while (cache.nbuckets < nentries)
+		cache.nbuckets <<= 1;
+	cache.buckets = malloc(cache.nbuckets * sizeof(uint32_t));
+	if (!cache.buckets) {
+		munmap(p, len);
+		return -1;
+	}
+	memset(cache.buckets, 0xff, cache.nbuckets * sizeof(uint32_t));
+
+	cache.file = p;
+	cache.map_len = len;
+	struct cache_file *f = cache.file;
+	if (f->magic != CACHE_MAGIC || f->version != CACHE_VERSION ||
+			f->nentries != nentries || f->grid != grid)
+		cache_reset(nentries, grid);
+
+	for (uint32_t i = 0; i < nentries; i++)
+		if (f->entries[i].valid)
+			hash_insert(i);
+	return 0;
+}
+
+void cache_close()
+{
+	if (!cache.file)
+		return;
+	msync(cache.file, cache.map_len, MS_SYNC);
+	munmap(cache.file, cache.map_len);
+	free(cache.buckets);
+	memset(&cache, 0, sizeof(cache));
+}
+
+uint64_t cache_hits()
+{
+	return __atomic_load_n(&cache.hits, __ATOMIC_RELAXED);
+}
+
+static uint32_t cache_find(const struct cache_key *key)
+{
+	struct cache_entry *entries = cache.file->entries;
+	uint32_t i = cache.buckets[key_hash(key)];
+	while (i != CACHE_NONE && memcmp(&entries[i].key, key, sizeof(*key)) != 0)
+		i = entries[i].hnext;
+	return i;
+}
+
+// add the cached histogram of key to counter, returns 0 if there is none
+static int cache_get(const struct cache_key *key, uint64_t *counter)
+{
+	pthread_mutex_lock(&cache_lock);
+	uint32_t i = cache_find(key);
+	if (i == CACHE_NONE) {
+		pthread_mutex_unlock(&cache_lock);
+		return 0;
+	}
+
+	struct cache_entry *e = &cache.file->entries[i];
+	for (int l = 0; l < NLETTERS; l++)
+		counter[l] += e->counter[l];
+	lru_unlink(i);
+	lru_push_front(i);
+	pthread_mutex_unlock(&cache_lock);
+	return 1;
+}
+
+// keep the histogram of key, in place of the least recently used one if
+// it is not cached yet
+static void cache_put(const struct cache_key *key, const uint64_t *counter)
+{
+	pthread_mutex_lock(&cache_lock);
+	struct cache_file *f = cache.file;
+	uint32_t i = cache_find(key);
+	if (i == CACHE_NONE) {
+		i = f->lru_tail;
+		if (f->entries[i].valid)
+			hash_remove(i);
+	}
+	struct cache_entry *e = &f->entries[i];
+
+	// the entry is only valid again once complete, in case the worker dies
+	// while the cache file is half written
+	if (!e->valid || memcmp(&e->key, key, sizeof(*key)) != 0) {
+		e->valid = 0;
+		e->key = *key;
+		hash_insert(i);
+	}
+	memcpy(e->counter, counter, sizeof(e->counter));
+	e->valid = 1;
+
+	lru_unlink(i);
+	lru_push_front(i);
+	pthread_mutex_unlock(&cache_lock);
+}
+
+// the bytes [*lo, *hi) of piece k of [start, end), which is cut at the
+// multiples of grid
+static void cache_piece(uint64_t start, uint64_t end, uint64_t grid, uint64_t k,
+		uint64_t *lo, uint64_t *hi)
+{
+	uint64_t first = start / grid;
+	*lo = k == 0 ? start : (first + k) * grid;
+	*hi = (first + k + 1) * grid < end ? (first + k + 1) * grid : end;
+}
+
+int cache_count_range(uint64_t *counter, const char *path, uint64_t start, uint64_t end)
+{
+	if (!cache.file)
+		return count_range(counter, path, start, end);
+
+	struct stat st;
+	if (stat(path, &st) < 0)
+		return -1;
+	if (!S_ISREG(st.st_mode))
+		return count_range(counter, path, start, end);
+
+	// never count past the end of file
+	if (end > (uint64_t)st.st_size)
+		end = st.st_size;
+	if (start >= end)
+		return 0;
+
+	struct cache_key key = {
+		.dev = st.st_dev, .ino = st.st_ino, .size = st.st_size,
+		.mtime_ns = st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec,
+		.start = start, .end = end,
+	};
+	if (cache_get(&key, counter)) {
+		__atomic_add_fetch(&cache.hits, 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+
+	// the range is cut at the multiples of the grid and each piece is cached
+	// too: the whole chunks for other ranges that line up with the grid, the
+	// unaligned head and tail for this one asked again
+	uint64_t grid = cache.file->grid;
+	uint64_t npieces = (end - 1) / grid - start / grid + 1;
+	uint64_t (*pieces)[NLETTERS] = calloc(npieces, sizeof(*pieces));
+	char *cached = calloc(npieces, 1);
+	if (!pieces || !cached) {
+		free(pieces);
+		free(cached);
+		return count_range(counter, path, start, end);
+	}
+
+	struct cache_key piece = key;
+	for (uint64_t k = 0; k < npieces; k++) {
+		cache_piece(start, end, grid, k, &piece.start, &piece.end);
+		cached[k] = cache_get(&piece, pieces[k]);
+	}
+
+	// the pieces missing next to each other are counted in a single pass,
+	// which splits them across threads as any range, and which adds up the
+	// histogram of each piece on the way
+	int ret = 0;
+	for (uint64_t k = 0, j; k < npieces && ret == 0; k = j) {
+		for (j = k; j < npieces && !cached[j]; j++)
+			;
+		if (j == k) {
+			j += 1;
+			continue;
+		}
+
+		uint64_t span[NLETTERS] = { 0 }, lo, hi, unused;
+		cache_piece(start, end, grid, k, &lo, &unused);
+		cache_piece(start, end, grid, j - 1, &unused, &hi);
+		ret = count_range_grid(span, path, lo, hi, grid, pieces + k);
+		for (uint64_t i = k; i < j && ret == 0; i++) {
+			cache_piece(start, end, grid, i, &piece.start, &piece.end);
+			cache_put(&piece, pieces[i]);
+		}
+	}
+
+	uint64_t part[NLETTERS] = { 0 };
+	for (uint64_t k = 0; k < npieces; k++)
+		for (int l = 0; l < NLETTERS; l++)
+			part[l] += pieces[k][l];
+	free(pieces);
+	free(cached);
+	if (ret < 0)
+		return -1;
+
+	cache_put(&key, part);
+	for (int l = 0; l < NLETTERS; l++)
+		counter[l] += part[l];
+	return 0;
+}
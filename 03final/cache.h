@@ -0,0 +1,36 @@
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include <stdint.h>
+
+#include "count.h"
+
+// default number of cached histograms, each takes a few hundred bytes
+#define CACHE_DEFAULT_ENTRIES 4096
+
+// default grid: the cache also keeps the histogram of every aligned chunk
+// of this size in a range, so ranges that differ but line up with the grid
+// are composed from the chunks they share
+#define CACHE_DEFAULT_GRID (16 << 20)
+
+// set up an LRU cache of nentries letter histograms keyed by file identity
+// (device, inode, mtime and size) and byte range. With a path, the cache is
+// kept in that file with mmap and survives restarts of the worker; if the
+// file is missing or was made with other parameters it starts empty.
+// Returns -1 if the cache file could not be opened or mapped.
+int cache_open(const char *path, uint32_t nentries, uint64_t grid);
+
+// flush the cache to its file and drop it
+void cache_close();
+
+// count_range through the cache: the cached histogram of the range if there
+// is one, or the sum of the cached grid chunks it covers, counting only
+// what is missing, each run of missing chunks in one threaded pass. Without
+// an open cache this is count_range. Threads may
+// count through the cache at the same time, only the entries are locked.
+int cache_count_range(uint64_t *counter, const char *path, uint64_t start, uint64_t end);
+
+// how many cache_count_range calls were answered without reading the file
+uint64_t cache_hits();
+
+#endif
@@ -0,0 +1,119 @@
+/* checks of the worker side histogram cache against uncached counts */
+
+#define _GNU_SOURCE		// mkstemp, utimensat
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "cache.h"
+#include "count.h"
+
+// small enough to cut the test file into many pieces, and to have the
+// slices of the counting threads cross them
+#define TEST_GRID (1 << 20)
+#define TEST_SIZE (24 * TEST_GRID + 12345)
+
+static char path[] = "/tmp/cachetest.XXXXXX";
+static int failed;
+
+static void write_file(unsigned seed)
+{
+	unsigned char *buf = malloc(TEST_SIZE);
+	srand(seed);
+	for (size_t i = 0; i < TEST_SIZE; i++)
+		buf[i] = rand() % 128;
+
+	FILE *fp = fopen(path, "w");
+	if (!fp || fwrite(buf, 1, TEST_SIZE, fp) != TEST_SIZE || fclose(fp) != 0) {
+		perror("write test file failed");
+		exit(1);
+	}
+	free(buf);
+}
+
+static void check(const char *what, uint64_t start, uint64_t end, const uint64_t *want)
+{
+	uint64_t got[NLETTERS] = { 0 };
+	if (cache_count_range(got, path, start, end) < 0 ||
+			memcmp(got, want, sizeof(got)) != 0) {
+		printf("FAIL %s [%lu, %lu)\n", what, (unsigned long)start, (unsigned long)end);
+		failed = 1;
+		return;
+	}
+	printf("ok   %s [%lu, %lu)\n", what, (unsigned long)start, (unsigned long)end);
+}
+
+static void uncached(uint64_t start, uint64_t end, uint64_t *counter)
+{
+	memset(counter, 0, NLETTERS * sizeof(uint64_t));
+	if (count_range(counter, path, start, end) < 0) {
+		perror("count test file failed");
+		exit(1);
+	}
+}
+
+static void test_reader(const char *reader)
+{
+	printf("reader %s\n", reader);
+	count_set_reader(reader);
+	write_file(1);
+	if (cache_open(NULL, 1024, TEST_GRID) < 0) {
+		perror("open cache failed");
+		exit(1);
+	}
+
+	// a range over many chunks, unaligned at both ends, counted cold and
+	// then answered from the cache
+	uint64_t whole[NLETTERS], aligned[NLETTERS], mixed[NLETTERS], beyond[NLETTERS];
+	uint64_t s = TEST_GRID / 3, e = 20 * TEST_GRID + 777;
+	uncached(s, e, whole);
+	uncached(2 * TEST_GRID, 9 * TEST_GRID, aligned);
+	uncached(TEST_GRID / 2, 6 * TEST_GRID, mixed);
+	uncached(18 * TEST_GRID + 5, TEST_SIZE + 1000, beyond);
+
+	check("miss", s, e, whole);
+	uint64_t hits = cache_hits();
+	check("hit", s, e, whole);
+	if (cache_hits() != hits + 1) {
+		printf("FAIL the second count was not a hit\n");
+		failed = 1;
+	}
+
+	// cached chunks next to a missing head, and missing chunks past the end
+	// of the first range
+	check("head and chunks", TEST_GRID / 2, 6 * TEST_GRID, mixed);
+	check("past the chunks", 18 * TEST_GRID + 5, TEST_SIZE + 1000, beyond);
+
+	// a range made of cached chunks only has to be composed from them: the
+	// file is rewritten with other bytes, but looks the same to the cache
+	struct stat st;
+	stat(path, &st);
+	write_file(2);
+	struct timespec times[2] = { st.st_atim, st.st_mtim };
+	utimensat(AT_FDCWD, path, times, 0);
+	check("grid composition", 2 * TEST_GRID, 9 * TEST_GRID, aligned);
+
+	cache_close();
+}
+
+int main()
+{
+	int fd = mkstemp(path);
+	if (fd < 0) {
+		perror("create test file failed");
+		return 1;
+	}
+	close(fd);
+
+	count_set_threads(4);
+	test_reader("mmap");
+	test_reader("pread");
+	test_reader("uring");
+
+	unlink(path);
+	return failed;
+}
@@ -1,134 +1,824 @@
 /* client application */
 
+#define _GNU_SOURCE		// accept4
+
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
 #include <unistd.h>
+#include <errno.h>
+#include <endian.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+
+#include "cache.h"
+#include "count.h"
+#include "proto.h"
+#include "words.h"
+
+// threads serving jobs, and how many jobs may wait for them over all
+// masters before the masters are not read from any more
+#define POOL_DEFAULT_THREADS 4
+#define POOL_DEFAULT_QUEUE 64
+
+// jobs received from one master but not served yet, at most READAHEAD
+#define READAHEAD 16
+
+// what the acceptor reads ahead of a master, room for the largest job
+#define MASTER_IN_SIZE (PROTO_HDR_SIZE + sizeof(struct proto_count) + PROTO_MAX_PATH + 4096)
+
+// a job received ahead of serving it. Path jobs name the file to read; of
+// shipped data only the header is read, the thread serving the job
+// receives the bytes as they stream in. A PROTO_ERROR job is a reply to a
+// job that could not be read, its message in path, so that the acceptor
+// never writes to a master itself.
+struct job {
+	int type;
+	uint32_t job_id;
+	uint64_t len;			// payload of shipped data
+	uint64_t start, end;
+	struct timespec started;
+	char path[PROTO_MAX_PATH + 1];
+};
+
+// a master connected to this worker
+//
+// Its socket does not block and is watched by the acceptor thread, which
+// reads whatever arrived into the buffer of the master and queues the jobs
+// once they are complete, as long as there is room. A master that sends
+// slowly never holds up the others. Jobs of one master may be served by
+// several threads at once, their replies are written whole under
+// send_lock.
+struct master {
+	int fd, id;
+	char in[MASTER_IN_SIZE];	// read ahead, in[in_off, in_len) not handled yet
+	size_t in_off, in_len;
+	uint64_t skip;			// payload still to be dropped
+	int partial;			// the buffered bytes are not a whole message
+	pthread_mutex_t send_lock;
+	struct job jobs[READAHEAD];
+	int head, n;
+	int refs;				// the acceptor and the jobs being served
+	int streaming;			// a thread receives shipped data from the socket
+	int paused, closed;
+	struct master *prev, *next;		// ring of masters with jobs queued
+	struct master *paused_next;
+};
+
+// the thread pool and the queues it serves, all under lock
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t ready;
+	struct master *ring;		// the master the next job is taken from
+	struct master *paused;		// masters waiting for room to be read from
+	int queued, limit;
+	int epfd, stopping;
+} pool = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.ready = PTHREAD_COND_INITIALIZER,
+	.limit = POOL_DEFAULT_QUEUE,
+};
+
+// send a reply to the master, whole even if other jobs reply at the same time
+static int master_send(struct master *m, int type, uint32_t job_id, const struct iovec *iov,
+		int iovcnt)
+{
+	pthread_mutex_lock(&m->send_lock);
+	int ret = proto_send(m->fd, type, job_id, iov, iovcnt);
+	pthread_mutex_unlock(&m->send_lock);
+	return ret;
+}
+
+// report a failed job to the master
+static int send_error(struct master *m, uint32_t job_id, const char *msg)
+{
+	struct iovec iov = { (void *)msg, strlen(msg) };
+	return master_send(m, PROTO_ERROR, job_id, &iov, 1);
+}
+
+static uint64_t job_busy_ns(struct job *job)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec - job->started.tv_sec) * 1000000000ULL + ts.tv_nsec
+		- job->started.tv_nsec;
+}
+
+// send the counters of a finished job to the master
+static int send_result(struct master *m, struct job *job, uint64_t *counter)
+{
+	uint64_t counter_buf[NLETTERS + 1];
+	hton64_array(counter_buf, counter, NLETTERS);
+	counter_buf[NLETTERS] = htobe64(job_busy_ns(job));
+	struct iovec iov = { counter_buf, sizeof(counter_buf) };
+	return master_send(m, PROTO_RESULT, job->job_id, &iov, 1);
+}
+
+// tell the master every word run of the job was sent
+static int send_words_done(struct master *m, struct job *job)
+{
+	uint64_t busy = htobe64(job_busy_ns(job));
+	struct iovec iov = { &busy, sizeof(busy) };
+	return master_send(m, PROTO_WORDS_DONE, job->job_id, &iov, 1);
+}
+
+// count the range of a counting job and send the result
+static int serve_count(struct master *m, struct job *job)
+{
+	uint64_t counter[NLETTERS] = { 0 };
+
+	// start counting work, repeated jobs are answered from the cache
+	if (cache_count_range(counter, job->path, job->start, job->end) < 0) {
+		char msg[PROTO_MAX_PATH + 64];
+		snprintf(msg, sizeof(msg), "counting %s failed: %s", job->path, strerror(errno));
+		return send_error(m, job->job_id, msg);
+	}
+
+	// send counting result
+	return send_result(m, job, counter);
+}
+
+// size of the buffer the shipped bytes are received into
+#define DATA_BUF_SIZE (1 << 18)
+
+// receive up to len bytes of shipped data: first what the acceptor read
+// ahead, then from the socket, waiting for it as it does not block.
+// Returns 0 if the master closed the connection.
+static ssize_t master_recv(struct master *m, void *buf, size_t len)
+{
+	if (m->in_off < m->in_len) {
+		size_t n = m->in_len - m->in_off < len ? m->in_len - m->in_off : len;
+		memcpy(buf, m->in + m->in_off, n);
+		m->in_off += n;
+		return n;
+	}
+
+	while (1) {
+		ssize_t n = recv(m->fd, buf, len, 0);
+		if (n >= 0)
+			return n;
+		if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			struct pollfd pfd = { m->fd, POLLIN, 0 };
+			poll(&pfd, 1, -1);
+		} else if (errno != EINTR) {
+			return -1;
+		}
+	}
+}
+
+static int master_recv_full(struct master *m, void *buf, size_t len)
+{
+	while (len > 0) {
+		ssize_t n = master_recv(m, buf, len);
+		if (n <= 0)
+			return -1;
+		buf = (char *)buf + n;
+		len -= n;
+	}
+	return 0;
+}
+
+// count the bytes shipped by the master as they arrive, nothing is staged
+static int serve_count_data(struct master *m, struct job *job)
+{
+	static __thread unsigned char *buf;
+	struct proto_count range;
+	uint64_t counter[NLETTERS] = { 0 };
+
+	if (!buf && !(buf = malloc(DATA_BUF_SIZE)))
+		return -1;
+
+	if (job->len < sizeof(range) || master_recv_full(m, &range, sizeof(range)) < 0)
+		return -1;
+	printf("job %u: shipped [%lu, %lu)\n", job->job_id, be64toh(range.start),
+			be64toh(range.end));
+
+	uint64_t left = job->len - sizeof(range);
+	while (left > 0) {
+		size_t want = left < DATA_BUF_SIZE ? left : DATA_BUF_SIZE;
+		ssize_t n = master_recv(m, buf, want);
+		if (n <= 0)
+			return -1;
+
+		count_buffer(counter, buf, n);
+		left -= n;
+	}
+
+	return send_result(m, job, counter);
+}
 
-// finish counting work for corresponding input counter buf, file path, counting range
-void count( uint32_t * counter, char * path, uint32_t start, uint32_t end)
+// the word counts of the job a thread serves, reused by every job
+static __thread word_map_t word_map;
+
+struct word_job {
+	struct master *master;
+	uint32_t job_id;
+};
+
+static int send_word_run(const char *buf, size_t len, void *arg)
+{
+	struct word_job *job = arg;
+	struct iovec iov = { (void *)buf, len };
+	return master_send(job->master, PROTO_WORD_RUN, job->job_id, &iov, 1);
+}
+
+// the map is the combiner: every word is sent once per run with its count
+// in the range, and a new run is started when the map gets too large
+static int flush_word_map(word_map_t *map, void *arg)
 {
-	char buffer;
-	FILE *fp = fopen(path, "r");
-	fseek(fp, start, SEEK_SET);
-	end -= start;
-	while(end--)
-	{
-		fread(&buffer, 1, 1, fp);
-		if( buffer >= 'a' && buffer <= 'z')         // count lower case letters
-			counter[(buffer-'a')%26]++;
-		else if( buffer >= 'A' && buffer <= 'Z')    // count upper case letters
-			counter[(buffer-'A')%26]++;
+	int ret = word_map_emit(map, send_word_run, arg);
+	word_map_clear(map);
+	return ret;
+}
+
+// count the words that start in the range of a word counting job and send
+// them as sorted runs
+static int serve_words(struct master *m, struct job *pj)
+{
+	struct word_job job = { m, pj->job_id };
+
+	word_map_clear(&word_map);
+	if (word_scan_file(&word_map, pj->path, pj->start, pj->end, flush_word_map, &job) < 0) {
+		char msg[PROTO_MAX_PATH + 64];
+		snprintf(msg, sizeof(msg), "counting words of %s failed: %s", pj->path,
+				strerror(errno));
+		return send_error(m, pj->job_id, msg);
 	}
-	fclose(fp);
+
+	if (flush_word_map(&word_map, &job) < 0)
+		return -1;
+	return send_words_done(m, pj);
 }
- 
+
+// count the words of the bytes shipped by the master as they arrive
+static int serve_words_data(struct master *m, struct job *pj)
+{
+	static __thread unsigned char *buf;
+	struct proto_count range;
+	struct word_job job = { m, pj->job_id };
+	word_scan_t scan;
+
+	if (!buf && !(buf = malloc(DATA_BUF_SIZE)))
+		return -1;
+
+	if (pj->len < sizeof(range) || master_recv_full(m, &range, sizeof(range)) < 0)
+		return -1;
+	uint64_t start = be64toh(range.start);
+	uint64_t end = be64toh(range.end);
+	printf("job %u: shipped words [%lu, %lu)\n", pj->job_id, start, end);
+
+	word_map_clear(&word_map);
+	word_scan_init(&scan, &word_map, start, end);
+
+	uint64_t left = pj->len - sizeof(range);
+	while (left > 0) {
+		size_t want = left < DATA_BUF_SIZE ? left : DATA_BUF_SIZE;
+		ssize_t n = master_recv(m, buf, want);
+		if (n <= 0)
+			return -1;
+
+		word_scan_feed(&scan, buf, n);
+		if (word_map_full(&word_map) && flush_word_map(&word_map, &job) < 0)
+			return -1;
+		left -= n;
+	}
+	word_scan_finish(&scan);
+	if (scan.failed)
+		return send_error(m, pj->job_id, "counting words failed: out of memory");
+
+	if (flush_word_map(&word_map, &job) < 0)
+		return -1;
+	return send_words_done(m, pj);
+}
+
+static int is_data_job(int type)
+{
+	return type == PROTO_COUNT_DATA || type == PROTO_WORDS_DATA;
+}
+
+// watch the socket of the master for the next message, once. Messages
+// already read ahead do not make the socket readable, the acceptor is woken
+// for them as soon as the socket is writable instead, which it nearly
+// always is.
+static void master_arm(struct master *m)
+{
+	if (m->closed)
+		return;
+	uint32_t events = EPOLLIN | EPOLLONESHOT;
+	if (m->in_off < m->in_len && !m->partial)
+		events |= EPOLLOUT;
+	struct epoll_event ev = { .events = events, .data.ptr = m };
+	epoll_ctl(pool.epfd, EPOLL_CTL_MOD, m->fd, &ev);
+}
+
+// the last reference closes the connection, pool.lock is held
+static void master_put(struct master *m)
+{
+	if (--m->refs > 0)
+		return;
+	close(m->fd);
+	pthread_mutex_destroy(&m->send_lock);
+	free(m);
+}
+
+// add the master at the end of the ring, behind every master with jobs
+static void ring_insert(struct master *m)
+{
+	if (!pool.ring) {
+		m->prev = m->next = m;
+		pool.ring = m;
+		return;
+	}
+	m->next = pool.ring;
+	m->prev = pool.ring->prev;
+	m->prev->next = m;
+	pool.ring->prev = m;
+}
+
+static void ring_remove(struct master *m)
+{
+	if (m->next == m) {
+		pool.ring = NULL;
+	} else {
+		m->prev->next = m->next;
+		m->next->prev = m->prev;
+		if (pool.ring == m)
+			pool.ring = m->next;
+	}
+	m->prev = m->next = NULL;
+}
+
+// whether another job may be read from the master
+static int master_has_room(struct master *m)
+{
+	return m->n < READAHEAD && pool.queued < pool.limit;
+}
+
+// queue a job received from the master for the threads
+static void master_queue(struct master *m, struct job *job)
+{
+	pthread_mutex_lock(&pool.lock);
+	m->jobs[(m->head + m->n) % READAHEAD] = *job;
+	if (m->n++ == 0)
+		ring_insert(m);
+	pool.queued += 1;
+
+	// the socket belongs to the thread serving shipped data until it
+	// received all of it
+	if (is_data_job(job->type))
+		m->streaming = 1;
+	pthread_cond_signal(&pool.ready);
+	pthread_mutex_unlock(&pool.lock);
+}
+
+// the master is gone: its queued jobs are dropped and the jobs being served
+// fail on the closed socket. pool.lock is held.
+static void master_close(struct master *m)
+{
+	printf("master %d: connection closed, %lu jobs answered from the cache\n", m->id,
+			cache_hits());
+	pool.queued -= m->n;
+	if (m->n > 0)
+		ring_remove(m);
+	m->n = 0;
+	if (m->paused) {
+		struct master **p = &pool.paused;
+		while (*p != m)
+			p = &(*p)->paused_next;
+		*p = m->paused_next;
+	}
+
+	epoll_ctl(pool.epfd, EPOLL_CTL_DEL, m->fd, NULL);
+	shutdown(m->fd, SHUT_RDWR);
+	m->closed = 1;
+	master_put(m);
+}
+
+// handle the next message read ahead of the master: jobs are queued and a
+// cancel drops its job from the queue. Of shipped data only the header is
+// handled here, the thread serving the job receives the rest. Returns 1 if
+// a message or part of a dropped payload was handled, 0 if more bytes are
+// needed and -1 if the master sent garbage.
+static int master_handle(struct master *m)
+{
+	size_t avail = m->in_len - m->in_off;
+	m->partial = 0;
+
+	// the payload of a message which is not handled
+	if (m->skip > 0) {
+		size_t n = m->skip < avail ? m->skip : avail;
+		m->in_off += n;
+		m->skip -= n;
+		return n > 0;
+	}
+
+	struct proto_hdr hdr;
+	if (avail < PROTO_HDR_SIZE) {
+		m->partial = 1;
+		return 0;
+	}
+	memcpy(&hdr, m->in + m->in_off, PROTO_HDR_SIZE);
+	if (proto_decode_hdr(&hdr) < 0)
+		return -1;
+	const char *payload = m->in + m->in_off + PROTO_HDR_SIZE;
+
+	struct job job;
+	struct proto_count range;
+	switch (hdr.type) {
+		case PROTO_COUNT:
+		case PROTO_WORDS: {
+			if (hdr.len < sizeof(range) || hdr.len - sizeof(range) > PROTO_MAX_PATH) {
+				m->in_off += PROTO_HDR_SIZE;
+				m->skip = hdr.len;
+				job.type = PROTO_ERROR;
+				job.job_id = hdr.job_id;
+				strcpy(job.path, "malformed job");
+				master_queue(m, &job);
+				return 1;
+			}
+			if (avail < PROTO_HDR_SIZE + hdr.len) {
+				m->partial = 1;
+				return 0;
+			}
+
+			// start and end point and the file path
+			size_t path_len = hdr.len - sizeof(range);
+			memcpy(&range, payload, sizeof(range));
+			memcpy(job.path, payload + sizeof(range), path_len);
+			job.path[path_len] = '\0';
+			job.type = hdr.type;
+			job.job_id = hdr.job_id;
+			job.start = be64toh(range.start);
+			job.end = be64toh(range.end);
+			printf("job %u: %s [%lu, %lu)\n", job.job_id, job.path, job.start, job.end);
+
+			m->in_off += PROTO_HDR_SIZE + hdr.len;
+			master_queue(m, &job);
+			return 1;
+		}
+		case PROTO_CANCEL:
+			// the job is only still queued if it was not started yet
+			pthread_mutex_lock(&pool.lock);
+			for (int i = 0; i < m->n; i++) {
+				struct job *queued = &m->jobs[(m->head + i) % READAHEAD];
+				if (queued->job_id == hdr.job_id && queued->type != PROTO_CANCEL) {
+					printf("job %u cancelled\n", hdr.job_id);
+					queued->type = PROTO_CANCEL;
+				}
+			}
+			pthread_mutex_unlock(&pool.lock);
+			m->in_off += PROTO_HDR_SIZE;
+			m->skip = hdr.len;
+			return 1;
+		case PROTO_COUNT_DATA:
+		case PROTO_WORDS_DATA:
+			// the buffer belongs to the thread serving the job from here on
+			job.type = hdr.type;
+			job.job_id = hdr.job_id;
+			job.len = hdr.len;
+			m->in_off += PROTO_HDR_SIZE;
+			master_queue(m, &job);
+			return 1;
+		default:
+			printf("unknown message type %d, ignore it\n", hdr.type);
+			m->in_off += PROTO_HDR_SIZE;
+			m->skip = hdr.len;
+			return 1;
+	}
+}
+
+// read what arrived from the master without blocking. Returns 1 if bytes
+// were read, 0 if none are there and -1 if the connection failed or was
+// closed.
+static int master_fill(struct master *m)
+{
+	if (m->in_off > 0) {
+		memmove(m->in, m->in + m->in_off, m->in_len - m->in_off);
+		m->in_len -= m->in_off;
+		m->in_off = 0;
+	}
+	// cannot happen, the largest message the acceptor waits for fits
+	if (m->in_len == sizeof(m->in))
+		return -1;
+
+	ssize_t n = recv(m->fd, m->in + m->in_len, sizeof(m->in) - m->in_len, 0);
+	if (n < 0)
+		return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+	if (n == 0)
+		return -1;
+	m->in_len += n;
+	return 1;
+}
+
+// handle what the master sent while there is room for its jobs. Whatever
+// already arrived is read ahead, so a cancel overtakes the jobs queued
+// before it; a master whose queue is full is not watched until a thread
+// takes one of the queued jobs, and TCP holds it back meanwhile.
+static void master_read(struct master *m)
+{
+	pthread_mutex_lock(&pool.lock);
+	while (!m->streaming && master_has_room(m)) {
+		pthread_mutex_unlock(&pool.lock);
+		int ret = master_handle(m);
+		if (ret == 0)
+			ret = master_fill(m);
+		pthread_mutex_lock(&pool.lock);
+		if (ret < 0) {
+			master_close(m);
+			pthread_mutex_unlock(&pool.lock);
+			return;
+		}
+		if (ret == 0)
+			break;
+	}
+
+	// the thread serving shipped data watches the socket again once done
+	if (!m->streaming && !master_has_room(m)) {
+		if (!m->paused) {
+			m->paused = 1;
+			m->paused_next = pool.paused;
+			pool.paused = m;
+		}
+	} else if (!m->streaming) {
+		master_arm(m);
+	}
+	pthread_mutex_unlock(&pool.lock);
+}
+
+// take the next job, one of every master with jobs queued in turn. Returns
+// NULL once the worker stops.
+static struct master *pool_take(struct job *job)
+{
+	pthread_mutex_lock(&pool.lock);
+	while (!pool.ring && !pool.stopping)
+		pthread_cond_wait(&pool.ready, &pool.lock);
+	if (pool.stopping) {
+		pthread_mutex_unlock(&pool.lock);
+		return NULL;
+	}
+
+	struct master *m = pool.ring;
+	*job = m->jobs[m->head];
+	m->head = (m->head + 1) % READAHEAD;
+	m->n -= 1;
+	m->refs += 1;
+	pool.queued -= 1;
+	pool.ring = m->next;
+	if (m->n == 0)
+		ring_remove(m);
+
+	// there is room again, the masters held back are read from
+	while (pool.paused) {
+		struct master *p = pool.paused;
+		pool.paused = p->paused_next;
+		p->paused = 0;
+		master_arm(p);
+	}
+	pthread_mutex_unlock(&pool.lock);
+	return m;
+}
+
+static void pool_done(struct master *m, struct job *job, int ret)
+{
+	pthread_mutex_lock(&pool.lock);
+
+	// a failed reply or transfer leaves the connection in an unknown state,
+	// the acceptor finds it shut down and drops the master
+	if (ret < 0 && !m->closed) {
+		printf("master %d: connection failed\n", m->id);
+		shutdown(m->fd, SHUT_RDWR);
+		if (!m->streaming)
+			master_arm(m);
+	}
+	if (is_data_job(job->type)) {
+		m->streaming = 0;
+		master_arm(m);
+	}
+	master_put(m);
+	pthread_mutex_unlock(&pool.lock);
+}
+
+static void *pool_thread(void *arg)
+{
+	struct job job;
+	struct master *m;
+
+	while ((m = pool_take(&job))) {
+		int ret = 0;
+		clock_gettime(CLOCK_MONOTONIC, &job.started);
+		if (job.type == PROTO_COUNT)
+			ret = serve_count(m, &job);
+		else if (job.type == PROTO_WORDS)
+			ret = serve_words(m, &job);
+		else if (job.type == PROTO_COUNT_DATA)
+			ret = serve_count_data(m, &job);
+		else if (job.type == PROTO_WORDS_DATA)
+			ret = serve_words_data(m, &job);
+		else if (job.type == PROTO_ERROR)
+			ret = send_error(m, job.job_id, job.path);
+		pool_done(m, &job, ret);
+	}
+	return NULL;
+}
+
+// accept every pending master and watch it for jobs
+static void accept_masters(int s)
+{
+	static int nmasters;
+	int on = 1, host;
+
+	while ((host = accept4(s, NULL, NULL, SOCK_NONBLOCK)) >= 0) {
+		struct master *m = calloc(1, sizeof(struct master));
+		if (!m) {
+			close(host);
+			continue;
+		}
+		setsockopt(host, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+		m->fd = host;
+		m->id = ++nmasters;
+		m->refs = 1;
+		pthread_mutex_init(&m->send_lock, NULL);
+
+		struct epoll_event ev = { .events = EPOLLIN | EPOLLONESHOT, .data.ptr = m };
+		if (epoll_ctl(pool.epfd, EPOLL_CTL_ADD, host, &ev) < 0) {
+			perror("watch connection failed");
+			pthread_mutex_destroy(&m->send_lock);
+			free(m);
+			close(host);
+			continue;
+		}
+		printf("master %d: connection accepted\n", m->id);
+	}
+	if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+		perror("accept failed");
+}
+
+static volatile sig_atomic_t stop;
+
+static void handle_stop(int sig)
+{
+	stop = 1;
+}
+
 int main(int argc, char *argv[])
 {
-    uint32_t s,host;
-    struct sockaddr_in server,client;
-    char server_send[2000];
-	uint32_t len_message, start, end;
-	uint32_t counter[26];
-	uint32_t i;
-	
-	
+    int s;
+    struct sockaddr_in server;
+	uint16_t port = 12345;
+	uint32_t cache_entries = CACHE_DEFAULT_ENTRIES;
+	uint64_t cache_grid = CACHE_DEFAULT_GRID;
+	const char *cache_path = NULL;
+	int nthreads = POOL_DEFAULT_THREADS;
+	int opt;
+
+
+	// parse options
+	while ((opt = getopt(argc, argv, "C:DG:j:k:P:p:Q:r:t:")) != -1) {
+		switch (opt) {
+			case 'k':
+				if (count_select_kernel(optarg) < 0) {
+					fprintf(stderr, "counting kernel %s is not available\n", optarg);
+					return 1;
+				}
+				break;
+			case 'p':
+				port = atoi(optarg);
+				break;
+			case 't':
+				count_set_threads(atoi(optarg));
+				break;
+			case 'j':
+				nthreads = atoi(optarg);
+				break;
+			case 'Q':
+				pool.limit = atoi(optarg);
+				break;
+			case 'C':
+				cache_entries = strtoul(optarg, NULL, 0);
+				break;
+			case 'G':
+				cache_grid = strtoull(optarg, NULL, 0);
+				break;
+			case 'P':
+				cache_path = optarg;
+				break;
+			case 'r':
+				if (count_set_reader(optarg) < 0) {
+					fprintf(stderr, "unknown reader %s\n", optarg);
+					return 1;
+				}
+				break;
+			case 'D':
+				count_set_direct(1);
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-p port] [-j threads] [-Q queued_jobs] "
+						"[-k auto|avx2|sse2|scalar] [-t threads] [-r mmap|uring|pread [-D]] "
+						"[-C cache_entries] [-G cache_grid] [-P cache_file]\n", argv[0]);
+				return 1;
+		}
+	}
+	if (nthreads < 1 || pool.limit < 1) {
+		fprintf(stderr, "at least one thread and one queued job are needed\n");
+		return 1;
+	}
+	if (cache_entries > 0 && cache_open(cache_path, cache_entries, cache_grid) < 0) {
+		perror("open result cache failed");
+		return 1;
+	}
+	printf("counting kernel: %s, threads: %d, reader: %s, serving threads: %d\n",
+			count_kernel_name(), count_get_threads(), count_reader_name(), nthreads);
+
+
     // create socket
-    if ((s = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+    if ((s = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0) {
         perror("Could not create socket");
 		return -1;
     }
     printf("Socket created\n");
-     
-	 
+	int on = 1;
+	setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+
     // prepare the sockaddr_in structure
     server.sin_family = AF_INET;
     server.sin_addr.s_addr = INADDR_ANY;
-    server.sin_port = htons(12345);
-     
-	 
+    server.sin_port = htons(port);
+
+
     // bind
     if (bind(s,(struct sockaddr *)&server, sizeof(server)) < 0) {
         perror("bind failed. Error");
         return -1;
     }
     printf("bind done");
-     
-	 
-    // listen
-    listen(s, 3);
-     
-	 
-    // accept and incoming connection
+
+
+    // listen, any number of masters may connect and share the worker
+    listen(s, SOMAXCONN);
+	if ((pool.epfd = epoll_create1(0)) < 0) {
+		perror("epoll_create1 failed");
+		return 1;
+	}
+	struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+	epoll_ctl(pool.epfd, EPOLL_CTL_ADD, s, &ev);
+
+	// a master that goes away must not kill the worker, and only this
+	// thread handles the signals that stop it
+	signal(SIGPIPE, SIG_IGN);
+	struct sigaction sa = { .sa_handler = handle_stop };
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sigset_t stop_signals, old_mask;
+	sigemptyset(&stop_signals);
+	sigaddset(&stop_signals, SIGINT);
+	sigaddset(&stop_signals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &stop_signals, &old_mask);
+
+	pthread_t *threads = calloc(nthreads, sizeof(pthread_t));
+	for (int i = 0; i < nthreads; i++) {
+		if (pthread_create(&threads[i], NULL, pool_thread, NULL) != 0) {
+			perror("create serving thread failed");
+			return 1;
+		}
+	}
+	pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+
+    // accept connections and read their jobs until stopped
     printf("Waiting for incoming connections...\n");
-     
-	 
-    // accept connection from an incoming client
-    uint32_t c = sizeof(struct sockaddr_in);
-    if ((host = accept(s, (struct sockaddr *)&client, (socklen_t *)&c)) < 0) {
-        perror("accept failed");
-        return 1;
+    while (!stop) {
+		struct epoll_event events[64];
+		int n = epoll_wait(pool.epfd, events, 64, -1);
+		if (n < 0 && errno != EINTR) {
+			perror("epoll_wait failed");
+			break;
+		}
+		for (int i = 0; i < n; i++) {
+			if (events[i].data.ptr)
+				master_read(events[i].data.ptr);
+			else
+				accept_masters(s);
+		}
     }
-    printf("Connection accepted\n"); 
-
-     
-    // keep communicating with server
-    while(1) {
-
-         
-        // receive message lenth from server
-        if (recv(host, &len_message, 4, 0) <= 0) {
-            printf("recv failed");
-            break;
-        }
-		len_message = ntohl( len_message );
-		printf("len_message: %d\n", len_message);
-		
-		
-		// receive file path
-		if (recv(host, server_send, len_message-8, 0) < 0) {
-            printf("recv failed");
-            break;
-        }
-		printf("path : %s\n",server_send);
-		
-		
-		// receive start and end point 
-		if (recv(host, &start, 4, 0) < 0) {
-            printf("recv failed");
-            break;
-        }
-		if (recv(host, &end, 4, 0) < 0) {
-            printf("recv failed");
-            break;
-        }
-		start = ntohl( start );
-		end = ntohl( end );
-		printf(" start : %d  end : %d \n", start, end);
-		
-		
-		// initialize counter
-		for( i = 0; i < 26; i++)
-			counter[i] = 0;
-		
-		
-		// start counting work
-		count(counter, server_send, start, end);
-		
-		for( i = 0; i < 26; i++)
-			counter[i] = htonl(counter[i]);
-		
-        // send counting result
-        if (send(host, counter, 104, 0) < 0) {
-            printf("Send failed");
-            return 1;
-        }
-         		
-        printf("counting message sended!!!!\n ");
 
-    }
-     
-    close(host);
+	// the jobs being served are finished, the queued ones dropped
+	pthread_mutex_lock(&pool.lock);
+	pool.stopping = 1;
+	pthread_cond_broadcast(&pool.ready);
+	pthread_mutex_unlock(&pool.lock);
+	for (int i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+
+    close(s);
+	printf("%lu jobs answered from the cache\n", cache_hits());
+	cache_close();
     return 0;
 }
@@ -0,0 +1,250 @@
+/* buffered non-blocking connections speaking the master/worker protocol */
+
+#include "conn.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+
+// messages gathered into one sendmsg at most
+#define CONN_MAX_IOV 64
+
+// room made in the input buffer before each read
+#define CONN_READ_SIZE (64 << 10)
+
+void conn_init(conn_t *c, int fd)
+{
+	memset(c, 0, sizeof(conn_t));
+	c->fd = fd;
+}
+
+static void out_pop(conn_t *c)
+{
+	struct out_msg *m = c->out_head;
+	c->out_head = m->next;
+	if (!c->out_head)
+		c->out_tail = NULL;
+	free(m);
+}
+
+void conn_close(conn_t *c)
+{
+	while (c->out_head)
+		out_pop(c);
+
+	free(c->in);
+	c->in = NULL;
+	c->in_off = c->in_len = c->in_cap = 0;
+
+	if (c->fd >= 0)
+		close(c->fd);
+	c->fd = -1;
+}
+
+int conn_queue(conn_t *c, int type, uint32_t job_id, const struct iovec *iov,
+		int iovcnt, int file_fd, uint64_t file_off, uint64_t file_len)
+{
+	size_t len = PROTO_HDR_SIZE;
+	for (int i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+
+	struct out_msg *m = malloc(sizeof(struct out_msg) + len);
+	if (!m)
+		return -1;
+
+	m->next = NULL;
+	m->job_id = job_id;
+	m->file_fd = file_fd;
+	m->file_off = file_off;
+	m->file_len = file_len;
+	m->len = len;
+	m->sent = 0;
+
+	proto_encode_hdr((struct proto_hdr *)m->head, type, job_id,
+			len - PROTO_HDR_SIZE + file_len);
+	char *p = m->head + PROTO_HDR_SIZE;
+	for (int i = 0; i < iovcnt; i++) {
+		memcpy(p, iov[i].iov_base, iov[i].iov_len);
+		p += iov[i].iov_len;
+	}
+
+	if (c->out_tail)
+		c->out_tail->next = m;
+	else
+		c->out_head = m;
+	c->out_tail = m;
+	return 0;
+}
+
+int conn_unqueue(conn_t *c, uint32_t job_id)
+{
+	struct out_msg **p = &c->out_head, *prev = NULL;
+	int n = 0;
+
+	while (*p) {
+		struct out_msg *m = *p;
+		if (m->job_id != job_id || m->sent > 0) {
+			prev = m;
+			p = &m->next;
+			continue;
+		}
+
+		*p = m->next;
+		if (c->out_tail == m)
+			c->out_tail = prev;
+		free(m);
+		n += 1;
+	}
+	return n;
+}
+
+static int would_block()
+{
+	return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+}
+
+// fallback when sendfile does not work on the file: copy one block
+static ssize_t copy_file_part(conn_t *c, struct out_msg *m)
+{
+	char buf[CONN_READ_SIZE];
+	size_t want = m->file_len < sizeof(buf) ? m->file_len : sizeof(buf);
+	ssize_t n = pread(m->file_fd, buf, want, m->file_off);
+	if (n <= 0)
+		return n == 0 ? (errno = EIO, -1) : -1;
+	return send(c->fd, buf, n, MSG_DONTWAIT);
+}
+
+// send the file range of the first message, returns 1 once it is all sent
+static int flush_file_part(conn_t *c, struct out_msg *m)
+{
+	while (m->file_len > 0) {
+		off_t pos = m->file_off;
+		size_t want = m->file_len < (1 << 30) ? m->file_len : (1 << 30);
+		ssize_t n = sendfile(c->fd, m->file_fd, &pos, want);
+		if (n < 0 && (errno == EINVAL || errno == ENOSYS))
+			n = copy_file_part(c, m);
+		if (n < 0)
+			return would_block() ? 0 : -1;
+		if (n == 0)
+			return -1;		// the file shrank under us
+
+		m->file_off += n;
+		m->file_len -= n;
+		c->bytes_out += n;
+	}
+	return 1;
+}
+
+int conn_flush(conn_t *c)
+{
+	while (c->out_head) {
+		struct iovec iov[CONN_MAX_IOV];
+		size_t total = 0;
+		int n = 0, more = 0;
+
+		// gather the pending heads up to the first one followed by file data
+		for (struct out_msg *m = c->out_head; m && n < CONN_MAX_IOV; m = m->next) {
+			if (m->sent < m->len) {
+				iov[n].iov_base = m->head + m->sent;
+				iov[n].iov_len = m->len - m->sent;
+				total += iov[n++].iov_len;
+			}
+			if (m->file_len) {
+				more = 1;
+				break;
+			}
+		}
+
+		if (n > 0) {
+			// MSG_MORE keeps a head in the same segment as its file data
+			struct msghdr msg = { .msg_iov = iov, .msg_iovlen = n };
+			ssize_t w = sendmsg(c->fd, &msg, MSG_DONTWAIT | (more ? MSG_MORE : 0));
+			if (w < 0)
+				return would_block() ? 0 : -1;
+			c->bytes_out += w;
+
+			// credit the written bytes to the messages in order
+			size_t left = w;
+			while (left > 0) {
+				struct out_msg *m = c->out_head;
+				size_t k = m->len - m->sent < left ? m->len - m->sent : left;
+				m->sent += k;
+				left -= k;
+				if (m->sent == m->len && !m->file_len)
+					out_pop(c);
+			}
+			if ((size_t)w < total)
+				return 0;
+		}
+
+		struct out_msg *m = c->out_head;
+		if (m && m->sent == m->len && m->file_len) {
+			int ret = flush_file_part(c, m);
+			if (ret <= 0)
+				return ret;
+			out_pop(c);
+		}
+	}
+	return 0;
+}
+
+int conn_fill(conn_t *c)
+{
+	// move the unparsed bytes to the front, and grow the buffer if a message
+	// larger than it is being received
+	if (c->in_off > 0) {
+		memmove(c->in, c->in + c->in_off, c->in_len - c->in_off);
+		c->in_len -= c->in_off;
+		c->in_off = 0;
+	}
+
+	size_t need = c->in_len + CONN_READ_SIZE;
+	if (c->in_len >= PROTO_HDR_SIZE) {
+		struct proto_hdr hdr = *(struct proto_hdr *)c->in;
+		if (proto_decode_hdr(&hdr) == 0 && hdr.len <= CONN_MAX_PAYLOAD &&
+				PROTO_HDR_SIZE + hdr.len > need)
+			need = PROTO_HDR_SIZE + hdr.len;
+	}
+	if (need > c->in_cap) {
+		char *in = realloc(c->in, need);
+		if (!in)
+			return -1;
+		c->in = in;
+		c->in_cap = need;
+	}
+
+	ssize_t n = recv(c->fd, c->in + c->in_len, c->in_cap - c->in_len, MSG_DONTWAIT);
+	if (n < 0)
+		return would_block() ? 0 : -1;
+	if (n == 0)
+		return -1;
+
+	c->in_len += n;
+	c->bytes_in += n;
+	return 0;
+}
+
+int conn_peek(conn_t *c, struct proto_hdr *hdr, char **payload)
+{
+	if (c->in_len - c->in_off < PROTO_HDR_SIZE)
+		return 0;
+
+	*hdr = *(struct proto_hdr *)(c->in + c->in_off);
+	if (proto_decode_hdr(hdr) < 0 || hdr->len > CONN_MAX_PAYLOAD)
+		return -1;
+	if (c->in_len - c->in_off < PROTO_HDR_SIZE + hdr->len)
+		return 0;
+
+	*payload = c->in + c->in_off + PROTO_HDR_SIZE;
+	return 1;
+}
+
+void conn_consume(conn_t *c, struct proto_hdr *hdr)
+{
+	c->in_off += PROTO_HDR_SIZE + hdr->len;
+	if (c->in_off == c->in_len)
+		c->in_off = c->in_len = 0;
+}
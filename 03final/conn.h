@@ -0,0 +1,73 @@
+#ifndef __CONN_H__
+#define __CONN_H__
+
+#include "proto.h"
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/uio.h>
+
+// largest message payload accepted from the peer
+#define CONN_MAX_PAYLOAD (64 << 20)
+
+// a message waiting to be written: head holds the header and the payload
+// built in memory, and [file_off, file_off + file_len) of file_fd follows it
+struct out_msg {
+	struct out_msg *next;
+	uint32_t job_id;
+	int file_fd;
+	uint64_t file_off, file_len;
+	size_t len, sent;
+	char head[];
+};
+
+// buffered protocol state of a non-blocking connection
+//
+// Outgoing messages are queued and written as the socket accepts them,
+// small ones gathered into one writev and file ranges sent with sendfile.
+// Incoming bytes are read into one buffer, in which complete messages are
+// parsed in place.
+typedef struct {
+	int fd;
+	struct out_msg *out_head, *out_tail;
+	char *in;				// unparsed input is in[in_off, in_len)
+	size_t in_off, in_len, in_cap;
+	uint64_t bytes_in, bytes_out;
+} conn_t;
+
+void conn_init(conn_t *c, int fd);
+
+// drop everything queued or buffered and close the socket
+void conn_close(conn_t *c);
+
+// queue a message with the payload gathered from iov and, if file_len is
+// not 0, followed by [file_off, file_off + file_len) of file_fd
+int conn_queue(conn_t *c, int type, uint32_t job_id, const struct iovec *iov,
+		int iovcnt, int file_fd, uint64_t file_off, uint64_t file_len);
+
+// drop the queued messages of job_id nothing of which was written yet,
+// returns how many were dropped
+int conn_unqueue(conn_t *c, uint32_t job_id);
+
+static inline int conn_want_write(conn_t *c)
+{
+	return c->out_head != NULL;
+}
+
+// write as much of the queue as the socket takes without blocking,
+// returns -1 if the connection failed
+int conn_flush(conn_t *c);
+
+// read what is available without blocking, returns -1 if the connection
+// failed or was closed by the peer
+int conn_fill(conn_t *c);
+
+// peek at the first complete message in the input buffer: returns 1 and
+// sets hdr and payload if there is one, 0 if more bytes are needed and -1
+// if the peer sent garbage
+int conn_peek(conn_t *c, struct proto_hdr *hdr, char **payload);
+
+// drop the message returned by conn_peek from the input buffer
+void conn_consume(conn_t *c, struct proto_hdr *hdr);
+
+#endif
@@ -0,0 +1,611 @@
+/* letter counting over a byte range of a file */
+
+#define _GNU_SOURCE		// O_DIRECT
+
+#include "count.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+
+#include "uring.h"
+
+// slot of each byte value in a sub-histogram, letters fold to 1..26 and
+// everything else lands in slot 0 which is never reported
+#define LETTER(i) ['a' + (i)] = (i) + 1, ['A' + (i)] = (i) + 1
+static const unsigned char letter_slot[256] = {
+	LETTER(0), LETTER(1), LETTER(2), LETTER(3), LETTER(4), LETTER(5),
+	LETTER(6), LETTER(7), LETTER(8), LETTER(9), LETTER(10), LETTER(11),
+	LETTER(12), LETTER(13), LETTER(14), LETTER(15), LETTER(16), LETTER(17),
+	LETTER(18), LETTER(19), LETTER(20), LETTER(21), LETTER(22), LETTER(23),
+	LETTER(24), LETTER(25),
+};
+#undef LETTER
+
+// bytes counted into the 32-bit sub-histograms before they are flushed
+#define SCALAR_BLOCK (1u << 30)
+
+// portable kernel: table lookup into 4 interleaved sub-histograms, so that
+// neighbouring bytes of the same letter do not wait on each other's
+// increment (store-to-load forwarding)
+static void count_scalar(uint64_t *counter, const unsigned char *buf, size_t len)
+{
+	uint32_t hist[4][NLETTERS + 1];
+
+	while (len > 0) {
+		size_t n = len < SCALAR_BLOCK ? len : SCALAR_BLOCK;
+		size_t i = 0;
+
+		memset(hist, 0, sizeof(hist));
+		for (; i + 4 <= n; i += 4) {
+			hist[0][letter_slot[buf[i]]]++;
+			hist[1][letter_slot[buf[i + 1]]]++;
+			hist[2][letter_slot[buf[i + 2]]]++;
+			hist[3][letter_slot[buf[i + 3]]]++;
+		}
+		for (; i < n; i++)
+			hist[0][letter_slot[buf[i]]]++;
+
+		for (int l = 0; l < NLETTERS; l++)
+			counter[l] += (uint64_t)hist[0][l + 1] + hist[1][l + 1] +
+				hist[2][l + 1] + hist[3][l + 1];
+
+		buf += n;
+		len -= n;
+	}
+}
+
+#ifdef __x86_64__
+#include <immintrin.h>
+
+// The vector kernels fold case with "| 0x20" (which maps exactly 'A'..'Z'
+// onto 'a'..'z' and no other byte into that range), then compare against
+// each letter and subtract the all-ones mask from per-letter byte counters.
+// Byte counters overflow after 255 vectors, so they are flushed into the
+// 64-bit totals with psadbw once per block. Letters are handled in groups
+// of 7 so that the counters and letter masks of a group stay in the 16
+// vector registers; the 4 groups cover 28 bins, the last 2 are discarded.
+#define SIMD_BLOCK 255
+#define SIMD_GROUP 7
+#define SIMD_BINS 28
+
+__attribute__((target("sse2")))
+static void count_sse2(uint64_t *counter, const unsigned char *buf, size_t len)
+{
+	const __m128i fold = _mm_set1_epi8(0x20);
+	const __m128i zero = _mm_setzero_si128();
+
+	uint64_t bins[SIMD_BINS] = { 0 };
+
+	while (len >= 16) {
+		size_t nvec = len / 16 < SIMD_BLOCK ? len / 16 : SIMD_BLOCK;
+
+#pragma GCC unroll 4
+		for (int g = 0; g < SIMD_BINS; g += SIMD_GROUP) {
+			__m128i acc[SIMD_GROUP], letter[SIMD_GROUP];
+#pragma GCC unroll 7
+			for (int l = 0; l < SIMD_GROUP; l++) {
+				acc[l] = zero;
+				letter[l] = _mm_set1_epi8('a' + g + l);
+			}
+
+			for (size_t v = 0; v < nvec; v++) {
+				__m128i x = _mm_or_si128(_mm_loadu_si128((const __m128i *)buf + v), fold);
+#pragma GCC unroll 7
+				for (int l = 0; l < SIMD_GROUP; l++)
+					acc[l] = _mm_sub_epi8(acc[l], _mm_cmpeq_epi8(x, letter[l]));
+			}
+
+#pragma GCC unroll 7
+			for (int l = 0; l < SIMD_GROUP; l++) {
+				__m128i s = _mm_sad_epu8(acc[l], zero);
+				bins[g + l] += (uint64_t)_mm_cvtsi128_si64(s) +
+					(uint64_t)_mm_cvtsi128_si64(_mm_unpackhi_epi64(s, s));
+			}
+		}
+
+		buf += nvec * 16;
+		len -= nvec * 16;
+	}
+
+	for (int l = 0; l < NLETTERS; l++)
+		counter[l] += bins[l];
+	count_scalar(counter, buf, len);
+}
+
+__attribute__((target("avx2")))
+static void count_avx2(uint64_t *counter, const unsigned char *buf, size_t len)
+{
+	const __m256i fold = _mm256_set1_epi8(0x20);
+	const __m256i zero = _mm256_setzero_si256();
+
+	uint64_t bins[SIMD_BINS] = { 0 };
+
+	while (len >= 32) {
+		size_t nvec = len / 32 < SIMD_BLOCK ? len / 32 : SIMD_BLOCK;
+
+#pragma GCC unroll 4
+		for (int g = 0; g < SIMD_BINS; g += SIMD_GROUP) {
+			__m256i acc[SIMD_GROUP], letter[SIMD_GROUP];
+#pragma GCC unroll 7
+			for (int l = 0; l < SIMD_GROUP; l++) {
+				acc[l] = zero;
+				letter[l] = _mm256_set1_epi8('a' + g + l);
+			}
+
+			for (size_t v = 0; v < nvec; v++) {
+				__m256i x = _mm256_or_si256(_mm256_loadu_si256((const __m256i *)buf + v), fold);
+#pragma GCC unroll 7
+				for (int l = 0; l < SIMD_GROUP; l++)
+					acc[l] = _mm256_sub_epi8(acc[l], _mm256_cmpeq_epi8(x, letter[l]));
+			}
+
+#pragma GCC unroll 7
+			for (int l = 0; l < SIMD_GROUP; l++) {
+				__m256i s = _mm256_sad_epu8(acc[l], zero);
+				__m128i t = _mm_add_epi64(_mm256_castsi256_si128(s),
+						_mm256_extracti128_si256(s, 1));
+				bins[g + l] += (uint64_t)_mm_cvtsi128_si64(t) +
+					(uint64_t)_mm_cvtsi128_si64(_mm_unpackhi_epi64(t, t));
+			}
+		}
+
+		buf += nvec * 32;
+		len -= nvec * 32;
+	}
+
+	for (int l = 0; l < NLETTERS; l++)
+		counter[l] += bins[l];
+	count_scalar(counter, buf, len);
+}
+
+static int have_sse2() { return __builtin_cpu_supports("sse2"); }
+static int have_avx2() { return __builtin_cpu_supports("avx2"); }
+#endif
+
+static int have_any() { return 1; }
+
+// ordered from the most to the least preferred kernel. The sse2 kernel is
+// not faster than the table driven scalar one (half the width of avx2 for
+// the same number of compares), so it is only used when asked for.
+const count_kernel_t count_kernels[] = {
+#ifdef __x86_64__
+	{ "avx2", count_avx2, have_avx2 },
+#endif
+	{ "scalar", count_scalar, have_any },
+#ifdef __x86_64__
+	{ "sse2", count_sse2, have_sse2 },
+#endif
+	{ NULL, NULL, NULL },
+};
+
+static void count_auto(uint64_t *counter, const unsigned char *buf, size_t len);
+
+// the counting threads read these while the first of them may still be
+// picking the kernel, so they are only accessed atomically
+static const count_kernel_t *count_kernel;
+static count_fn count_impl = count_auto;
+
+static pthread_once_t count_auto_once = PTHREAD_ONCE_INIT;
+
+static void count_select_best()
+{
+	count_select_kernel(NULL);
+}
+
+// the first call picks the best kernel the cpu supports, once, however
+// many threads make it at the same time
+static void count_auto(uint64_t *counter, const unsigned char *buf, size_t len)
+{
+	pthread_once(&count_auto_once, count_select_best);
+	__atomic_load_n(&count_impl, __ATOMIC_ACQUIRE)(counter, buf, len);
+}
+
+int count_select_kernel(const char *name)
+{
+	for (const count_kernel_t *k = count_kernels; k->name; k++) {
+		if (!k->supported())
+			continue;
+		if (!name || strcmp(name, "auto") == 0 || strcmp(name, k->name) == 0) {
+			__atomic_store_n(&count_kernel, k, __ATOMIC_RELEASE);
+			__atomic_store_n(&count_impl, k->fn, __ATOMIC_RELEASE);
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+const char *count_kernel_name()
+{
+	if (!__atomic_load_n(&count_kernel, __ATOMIC_ACQUIRE))
+		pthread_once(&count_auto_once, count_select_best);
+	return __atomic_load_n(&count_kernel, __ATOMIC_ACQUIRE)->name;
+}
+
+void count_buffer(uint64_t *counter, const unsigned char *buf, size_t len)
+{
+	__atomic_load_n(&count_impl, __ATOMIC_ACQUIRE)(counter, buf, len);
+}
+
+// where a count also adds up the letters of each piece of its range, the
+// range being cut at the multiples of grid; pieces[0] is the piece of the
+// first byte counted
+struct count_grid {
+	uint64_t grid;
+	uint64_t first;				// the piece of the first byte, in grids
+	uint64_t (*pieces)[NLETTERS];
+};
+
+// count buf, the bytes at off in the file, into counter, and into the
+// pieces of g if there are any. The threads counting a range share them.
+static void count_at(uint64_t *counter, const unsigned char *buf, uint64_t off,
+		size_t len, const struct count_grid *g)
+{
+	if (!g) {
+		count_buffer(counter, buf, len);
+		return;
+	}
+
+	while (len > 0) {
+		uint64_t k = off / g->grid;
+		size_t n = (k + 1) * g->grid - off;
+		if (n > len)
+			n = len;
+
+		uint64_t part[NLETTERS] = { 0 };
+		count_buffer(part, buf, n);
+		uint64_t *piece = g->pieces[k - g->first];
+		for (int l = 0; l < NLETTERS; l++) {
+			counter[l] += part[l];
+			__atomic_add_fetch(&piece[l], part[l], __ATOMIC_RELAXED);
+		}
+
+		buf += n;
+		off += n;
+		len -= n;
+	}
+}
+
+static int count_threads;
+
+void count_set_threads(int nthreads)
+{
+	count_threads = nthreads;
+}
+
+int count_get_threads()
+{
+	if (count_threads > 0)
+		return count_threads;
+
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? n : 1;
+}
+
+// one slice of a range, counted by a thread into its private histogram
+struct count_slice {
+	pthread_t tid;
+	uint64_t counter[NLETTERS];
+	const unsigned char *buf;	// mapped bytes of the slice, NULL to pread
+	int fd;
+	uint64_t start, end;
+	const struct count_grid *grid;
+	int ret;
+};
+
+static int count_read(uint64_t *counter, int fd, uint64_t start, uint64_t end,
+		const struct count_grid *g);
+
+static void *count_slice_thread(void *arg)
+{
+	struct count_slice *slice = arg;
+
+	if (slice->buf)
+		count_at(slice->counter, slice->buf, slice->start, slice->end - slice->start,
+				slice->grid);
+	else
+		slice->ret = count_read(slice->counter, slice->fd, slice->start, slice->end,
+				slice->grid);
+
+	return NULL;
+}
+
+// split [start, end) into one slice per thread and add up their histograms,
+// buf points to the mapped bytes of start, or is NULL if fd has to be read
+static int count_split(uint64_t *counter, const unsigned char *buf, int fd,
+		uint64_t start, uint64_t end, const struct count_grid *g)
+{
+	uint64_t len = end - start;
+	int n = count_get_threads();
+	if (n > len / COUNT_MIN_SLICE)
+		n = len / COUNT_MIN_SLICE;
+	if (n <= 1) {
+		if (buf) {
+			count_at(counter, buf, start, len, g);
+			return 0;
+		}
+		return count_read(counter, fd, start, end, g);
+	}
+
+	struct count_slice *slices = calloc(n, sizeof(struct count_slice));
+	if (!slices)
+		return -1;
+
+	// slices start at page boundaries so that no page is touched by two threads
+	for (int i = 0; i < n; i++) {
+		slices[i].fd = fd;
+		slices[i].grid = g;
+		slices[i].start = i == 0 ? start : slices[i - 1].end;
+		slices[i].end = i == n - 1 ? end : (start + len * (i + 1) / n) & ~4095ULL;
+		if (slices[i].end < slices[i].start)
+			slices[i].end = slices[i].start;
+		if (buf)
+			slices[i].buf = buf + (slices[i].start - start);
+	}
+
+	// the calling thread counts the first slice itself
+	for (int i = 1; i < n; i++) {
+		if (pthread_create(&slices[i].tid, NULL, count_slice_thread, &slices[i]) != 0) {
+			count_slice_thread(&slices[i]);
+			slices[i].tid = 0;
+		}
+	}
+	count_slice_thread(&slices[0]);
+
+	int ret = 0;
+	for (int i = 0; i < n; i++) {
+		if (i > 0 && slices[i].tid)
+			pthread_join(slices[i].tid, NULL);
+		if (slices[i].ret < 0)
+			ret = -1;
+		for (int l = 0; l < NLETTERS; l++)
+			counter[l] += slices[i].counter[l];
+	}
+
+	free(slices);
+	return ret;
+}
+
+// map [start, end) of fd and count it in place, the mapping has to begin at
+// a page boundary, so the bytes before start in the first page are skipped
+static int count_mapped(uint64_t *counter, int fd, uint64_t start, uint64_t end,
+		const struct count_grid *g)
+{
+	uint64_t page = sysconf(_SC_PAGESIZE);
+	uint64_t map_start = start & ~(page - 1);
+	size_t map_len = end - map_start;
+
+	unsigned char *map = mmap(NULL, map_len, PROT_READ, MAP_PRIVATE, fd, map_start);
+	if (map == MAP_FAILED)
+		return -1;
+
+	// hints only, failures (e.g. no THP for page cache) are harmless
+	madvise(map, map_len, MADV_SEQUENTIAL);
+	madvise(map, map_len, MADV_WILLNEED);
+#ifdef MADV_HUGEPAGE
+	madvise(map, map_len, MADV_HUGEPAGE);
+#endif
+
+	int ret = count_split(counter, map + (start - map_start), fd, start, end, g);
+
+	munmap(map, map_len);
+	return ret;
+}
+
+// fallback for files which could not be mapped (pipes, some network fs)
+static int count_read(uint64_t *counter, int fd, uint64_t start, uint64_t end,
+		const struct count_grid *g)
+{
+	unsigned char *buf = malloc(COUNT_READ_BUF_SIZE);
+	if (!buf)
+		return -1;
+
+	while (start < end) {
+		size_t want = end - start;
+		if (want > COUNT_READ_BUF_SIZE)
+			want = COUNT_READ_BUF_SIZE;
+
+		ssize_t n = pread(fd, buf, want, start);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			free(buf);
+			return n < 0 ? -1 : 0;
+		}
+
+		count_at(counter, buf, start, n, g);
+		start += n;
+	}
+
+	free(buf);
+	return 0;
+}
+
+// reads are aligned to this, as O_DIRECT wants
+#define URING_ALIGN 4096
+
+// one buffer of the uring reader and the read into it
+struct uring_block {
+	unsigned char *buf;
+	uint64_t off;
+	unsigned len;
+	unsigned done;			// read and counted so far
+	unsigned at;			// where the read in flight starts
+};
+
+// queue the next block of [*next, end) into b
+static int uring_queue_block(uring_t *u, int fd, struct uring_block *b, int i,
+		uint64_t *next, uint64_t end)
+{
+	uint64_t want = (end - *next + URING_ALIGN - 1) & ~(uint64_t)(URING_ALIGN - 1);
+	b->off = *next;
+	b->len = want < COUNT_URING_BLOCK ? want : COUNT_URING_BLOCK;
+	b->done = b->at = 0;
+	*next += b->len;
+	return uring_prep_read(u, fd, b->buf, b->len, b->off, i);
+}
+
+// keep COUNT_URING_DEPTH reads of [start, end) in flight and count every
+// block as soon as it completes, while the others are still being read.
+// Returns 1 without counting anything if io_uring is not available, or
+// cannot read the file: the first read failing with EINVAL or EOPNOTSUPP
+// means the kernel lacks the read op, or the file system rejects O_DIRECT
+// reads it accepted at open.
+static int count_uring(uint64_t *counter, int fd, uint64_t start, uint64_t end,
+		const struct count_grid *g)
+{
+	uring_t u;
+	if (uring_init(&u, COUNT_URING_DEPTH) < 0)
+		return 1;
+
+	struct uring_block blocks[COUNT_URING_DEPTH];
+	unsigned char *bufs;
+	if (posix_memalign((void **)&bufs, URING_ALIGN,
+				(size_t)COUNT_URING_DEPTH * COUNT_URING_BLOCK) != 0) {
+		// without buffers for the ring, the range is read the slow way
+		uring_exit(&u);
+		return 1;
+	}
+
+	uint64_t next = start & ~(uint64_t)(URING_ALIGN - 1);
+	int inflight = 0, ret = 0, err = 0, reaped = 0, unsupported = 0;
+	for (int i = 0; i < COUNT_URING_DEPTH && next < end; i++, inflight++) {
+		blocks[i].buf = bufs + (size_t)i * COUNT_URING_BLOCK;
+		uring_queue_block(&u, fd, &blocks[i], i, &next, end);
+	}
+
+	while (inflight > 0) {
+		if (uring_submit(&u, 1) < 0) {
+			err = errno;
+			ret = -1;
+			break;
+		}
+
+		uint64_t data;
+		int res;
+		while (uring_reap(&u, &data, &res)) {
+			struct uring_block *b = &blocks[data];
+			inflight -= 1;
+			if (res < 0 && ret == 0) {
+				err = -res;
+				ret = -1;
+				unsupported = reaped == 0 && (err == EINVAL || err == EOPNOTSUPP);
+			}
+			reaped += 1;
+			// once a read failed the others are only waited for
+			if (ret < 0)
+				continue;
+
+			// only the bytes in [start, end) not counted yet count, a short
+			// read is continued from an aligned offset before them
+			unsigned done = b->at + res > b->done ? b->at + res : b->done;
+			uint64_t lo = b->off + b->done, hi = b->off + done;
+			if (lo < start)
+				lo = start;
+			if (hi > end)
+				hi = end;
+			if (hi > lo)
+				count_at(counter, b->buf + (lo - b->off), lo, hi - lo, g);
+			int progress = done > b->done;
+			b->done = done;
+
+			// the end of file, or a read giving nothing new, ends the block
+			int more;
+			if (progress && b->done < b->len && b->off + b->done < end) {
+				b->at = b->done & ~(URING_ALIGN - 1);
+				more = uring_prep_read(&u, fd, b->buf + b->at, b->len - b->at,
+						b->off + b->at, data) == 0;
+			} else {
+				more = next < end && uring_queue_block(&u, fd, b, data, &next, end) == 0;
+			}
+			inflight += more;
+		}
+	}
+
+	// the kernel may still write into the buffers until every read is reaped
+	if (inflight == 0)
+		free(bufs);
+	uring_exit(&u);
+	if (unsupported && inflight == 0)
+		return 1;
+	errno = err;
+	return ret;
+}
+
+static enum { READER_MMAP, READER_URING, READER_PREAD } count_reader;
+static int count_direct;
+
+static const char *reader_names[] = { "mmap", "uring", "pread" };
+
+int count_set_reader(const char *name)
+{
+	for (int i = 0; i < 3; i++) {
+		if (strcmp(name, reader_names[i]) == 0) {
+			count_reader = i;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+const char *count_reader_name()
+{
+	return reader_names[count_reader];
+}
+
+void count_set_direct(int direct)
+{
+	count_direct = direct;
+}
+
+int count_range(uint64_t *counter, const char *path, uint64_t start, uint64_t end)
+{
+	return count_range_grid(counter, path, start, end, 0, NULL);
+}
+
+int count_range_grid(uint64_t *counter, const char *path, uint64_t start, uint64_t end,
+		uint64_t grid, uint64_t (*pieces)[NLETTERS])
+{
+	struct count_grid cg = { grid, grid ? start / grid : 0, pieces };
+	const struct count_grid *g = grid && pieces ? &cg : NULL;
+
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	// never count past the end of file
+	struct stat st;
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && end > (uint64_t)st.st_size)
+		end = st.st_size;
+
+	int ret = 0;
+	if (start < end && count_reader == READER_URING) {
+		// O_DIRECT bypasses the page cache, where the file system supports it
+		int direct_fd = count_direct ? open(path, O_RDONLY | O_DIRECT) : -1;
+		ret = count_uring(counter, direct_fd >= 0 ? direct_fd : fd, start, end, g);
+		if (direct_fd >= 0) {
+			int err = errno;
+			close(direct_fd);
+			errno = err;
+		}
+		if (ret > 0)
+			ret = count_split(counter, NULL, fd, start, end, g);
+	} else if (start < end && count_reader == READER_PREAD) {
+		ret = count_split(counter, NULL, fd, start, end, g);
+	} else if (start < end && count_mapped(counter, fd, start, end, g) < 0) {
+		ret = count_split(counter, NULL, fd, start, end, g);
+	}
+
+	// keep the errno of a failed read for the caller
+	int err = errno;
+	close(fd);
+	errno = err;
+	return ret;
+}
@@ -0,0 +1,76 @@
+#ifndef __COUNT_H__
+#define __COUNT_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define NLETTERS 26
+
+// size of the buffer used when the range could not be mapped
+#define COUNT_READ_BUF_SIZE (1 << 20)
+
+// a range is only split across threads in slices of at least this size
+#define COUNT_MIN_SLICE (1 << 20)
+
+// reads the uring reader keeps in flight, and their size
+#define COUNT_URING_DEPTH 8
+#define COUNT_URING_BLOCK (1 << 20)
+
+typedef void (*count_fn)(uint64_t *counter, const unsigned char *buf, size_t len);
+
+// a letter counting kernel, supported() tells whether this cpu can run it
+typedef struct {
+	const char *name;
+	count_fn fn;
+	int (*supported)();
+} count_kernel_t;
+
+// all the kernels built in, terminated by an entry with NULL name
+extern const count_kernel_t count_kernels[];
+
+// choose the kernel used by count_buffer: "avx2", "sse2", "scalar", or
+// NULL / "auto" for the best one supported by this cpu. Returns -1 if the
+// kernel is unknown or not supported.
+int count_select_kernel(const char *name);
+const char *count_kernel_name();
+
+// add the letters in buf[0, len) to counter, case insensitive
+void count_buffer(uint64_t *counter, const unsigned char *buf, size_t len);
+
+// number of threads count_range splits a range across, 0 (the default)
+// means one per online cpu
+void count_set_threads(int nthreads);
+int count_get_threads();
+
+// how count_range reads the file: "mmap" (the default, best when the file
+// is in the page cache), "uring" (a queue of large reads in flight with
+// io_uring, best for files that are not cached) or "pread". Returns -1 if
+// the reader is unknown.
+int count_set_reader(const char *name);
+const char *count_reader_name();
+
+// open the file with O_DIRECT for the uring reader, so that cold reads
+// bypass the page cache; ignored where the file system does not support it
+void count_set_direct(int direct);
+
+// count the letters of file path in the byte range [start, end)
+//
+// By default the range is mapped with mmap and counted in place; if the
+// file could not be mapped, it is read with large pread calls instead.
+// Either way the range is split into one slice per thread, each counted
+// into a private histogram and added up at the end. The uring reader counts
+// each block on the calling thread as soon as it is read, while the next
+// ones are in flight, and falls back to pread if io_uring is not available
+// or cannot read the file.
+// Returns 0 on success and -1 with errno set if the file could not be
+// opened or read.
+int count_range(uint64_t *counter, const char *path, uint64_t start, uint64_t end);
+
+// count_range, which also adds the letters of every piece of [start, end)
+// cut at the multiples of grid to pieces, pieces[0] being the piece of
+// start. pieces must hold (end - 1) / grid - start / grid + 1 zeroed
+// histograms, those past the end of file are left alone.
+int count_range_grid(uint64_t *counter, const char *path, uint64_t start, uint64_t end,
+		uint64_t grid, uint64_t (*pieces)[NLETTERS]);
+
+#endif
@@ -0,0 +1,209 @@
+/* microbenchmark for the letter counting kernels */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#ifdef __x86_64__
+#include <x86intrin.h>
+#endif
+
+#include "count.h"
+
+// the original per-byte loop of the worker, used to check every kernel
+static void count_reference(uint64_t *counter, const unsigned char *buf, size_t len)
+{
+	for (size_t i = 0; i < len; i++) {
+		char c = buf[i];
+		if (c >= 'a' && c <= 'z')
+			counter[c - 'a']++;
+		else if (c >= 'A' && c <= 'Z')
+			counter[c - 'A']++;
+	}
+}
+
+static uint64_t cycles()
+{
+#ifdef __x86_64__
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static unsigned char *load_file(const char *path, size_t *len)
+{
+	FILE *fp = fopen(path, "r");
+	if (!fp) {
+		perror("open input failed");
+		exit(1);
+	}
+	fseek(fp, 0, SEEK_END);
+	*len = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+
+	unsigned char *buf = malloc(*len);
+	if (fread(buf, 1, *len, fp) != *len) {
+		perror("read input failed");
+		exit(1);
+	}
+	fclose(fp);
+	return buf;
+}
+
+// mostly letters and spaces, with some punctuation and non-ascii bytes
+static unsigned char *make_text(size_t len)
+{
+	unsigned char *buf = malloc(len);
+	srand(12345);
+	for (size_t i = 0; i < len; i++) {
+		int r = rand() % 100;
+		if (r < 40)
+			buf[i] = 'a' + rand() % 26;
+		else if (r < 70)
+			buf[i] = 'A' + rand() % 26;
+		else if (r < 85)
+			buf[i] = ' ';
+		else
+			buf[i] = rand() % 256;
+	}
+	return buf;
+}
+
+// throughput of count_range over the whole file with each reader; drop the
+// page cache before each run (echo 3 > /proc/sys/vm/drop_caches) to measure
+// cold reads
+static int bench_readers(const char *path, int direct)
+{
+	const char *readers[] = { "mmap", "uring", "pread" };
+	uint64_t expect[NLETTERS] = { 0 };
+	int ok = 1;
+
+	count_set_direct(direct);
+	printf("%-8s %10s  %s\n", "reader", "GB/s", "check");
+	for (int i = 0; i < 3; i++) {
+		uint64_t counter[NLETTERS] = { 0 };
+		count_set_reader(readers[i]);
+
+		double t0 = now();
+		if (count_range(counter, path, 0, UINT64_MAX) < 0) {
+			perror("count_range failed");
+			return 1;
+		}
+		double t1 = now();
+
+		uint64_t total = 0;
+		for (int l = 0; l < NLETTERS; l++)
+			total += counter[l];
+		if (i == 0)
+			memcpy(expect, counter, sizeof(expect));
+		int same = memcmp(expect, counter, sizeof(expect)) == 0;
+		ok &= same;
+
+		struct stat st;
+		stat(path, &st);
+		printf("%-8s %10.3f  %s (%lu letters)\n", readers[i], st.st_size / (t1 - t0) / 1e9,
+				same ? "ok" : "MISMATCH", total);
+	}
+	return ok ? 0 : 1;
+}
+
+int main(int argc, char *argv[])
+{
+	size_t len = 64 << 20;
+	int rounds = 5;
+	int readers = 0, direct = 0;
+	const char *path = NULL;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "DRs:r:")) != -1) {
+		switch (opt) {
+			case 's':
+				len = strtoull(optarg, NULL, 0);
+				break;
+			case 'r':
+				rounds = atoi(optarg);
+				break;
+			case 'R':
+				readers = 1;
+				break;
+			case 'D':
+				direct = 1;
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-s bytes] [-r rounds] [file]\n"
+						"       %s -R [-D] file\n", argv[0], argv[0]);
+				return 1;
+		}
+	}
+	if (optind < argc)
+		path = argv[optind];
+	if (readers) {
+		if (!path) {
+			fprintf(stderr, "the readers are measured on a file\n");
+			return 1;
+		}
+		return bench_readers(path, direct);
+	}
+
+	unsigned char *buf = path ? load_file(path, &len) : make_text(len);
+
+	uint64_t expect[NLETTERS] = { 0 };
+	count_reference(expect, buf, len);
+
+	printf("%-8s %10s %10s  %s\n", "kernel", "bytes/cyc", "GB/s", "check");
+	for (const count_kernel_t *k = count_kernels; k->name; k++) {
+		if (!k->supported()) {
+			printf("%-8s %10s %10s  %s\n", k->name, "-", "-", "unsupported");
+			continue;
+		}
+
+		// odd offsets and lengths exercise the unaligned heads and tails
+		int ok = 1;
+		for (size_t off = 0; off < 64 && off < len; off += 7) {
+			uint64_t want[NLETTERS] = { 0 }, got[NLETTERS] = { 0 };
+			size_t n = (len - off) - (len - off) % 1000 + off % 5;
+			if (n > len - off)
+				n = len - off;
+			count_reference(want, buf + off, n);
+			k->fn(got, buf + off, n);
+			if (memcmp(want, got, sizeof(want)) != 0)
+				ok = 0;
+		}
+
+		uint64_t best_cyc = UINT64_MAX;
+		double best_sec = 1e9;
+		for (int r = 0; r < rounds; r++) {
+			uint64_t counter[NLETTERS] = { 0 };
+			double t0 = now();
+			uint64_t c0 = cycles();
+			k->fn(counter, buf, len);
+			uint64_t c1 = cycles();
+			double t1 = now();
+
+			if (memcmp(counter, expect, sizeof(expect)) != 0)
+				ok = 0;
+			if (c1 - c0 < best_cyc)
+				best_cyc = c1 - c0;
+			if (t1 - t0 < best_sec)
+				best_sec = t1 - t0;
+		}
+
+		printf("%-8s %10.3f %10.3f  %s\n", k->name,
+				best_cyc ? (double)len / best_cyc : 0.0,
+				len / best_sec / 1e9, ok ? "ok" : "MISMATCH");
+	}
+
+	free(buf);
+	return 0;
+}
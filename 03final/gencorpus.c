@@ -0,0 +1,130 @@
+/* synthetic text corpus for benchmarking, e.g. ./gencorpus -s 1G corpus.txt */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#define DEFAULT_VOCAB 50000
+#define MAX_WORD_LEN 14
+
+// xorshift64*, the same corpus for the same seed everywhere
+static uint64_t rng_state;
+
+static uint64_t rng()
+{
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return rng_state * 0x2545f4914f6cdd1dULL;
+}
+
+// parse a byte count with an optional K, M or G suffix
+static uint64_t parse_size(const char *str)
+{
+	char *end;
+	uint64_t size = strtoull(str, &end, 0);
+	switch (*end) {
+		case 'g': case 'G': size <<= 10;
+		case 'm': case 'M': size <<= 10;
+		case 'k': case 'K': size <<= 10;
+	}
+	return size;
+}
+
+int main(int argc, char *argv[])
+{
+	uint64_t size = 64 << 20;
+	int nvocab = DEFAULT_VOCAB;
+	int opt;
+
+	rng_state = 12345;
+	while ((opt = getopt(argc, argv, "s:v:r:")) != -1) {
+		switch (opt) {
+			case 's':
+				size = parse_size(optarg);
+				break;
+			case 'v':
+				nvocab = atoi(optarg);
+				break;
+			case 'r':
+				rng_state = strtoull(optarg, NULL, 0) | 1;
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-s size] [-v vocabulary] [-r seed] output\n",
+						argv[0]);
+				return 1;
+		}
+	}
+	if (optind >= argc || nvocab < 1) {
+		fprintf(stderr, "Usage: %s [-s size] [-v vocabulary] [-r seed] output\n", argv[0]);
+		return 1;
+	}
+
+	FILE *fp = fopen(argv[optind], "w");
+	if (!fp) {
+		perror("open output failed");
+		return 1;
+	}
+
+	// random words, drawn with a zipf distribution like natural text
+	char (*vocab)[MAX_WORD_LEN + 1] = malloc(nvocab * sizeof(*vocab));
+	double *cdf = malloc(nvocab * sizeof(double));
+	double sum = 0;
+	for (int i = 0; i < nvocab; i++) {
+		int len = 1 + rng() % MAX_WORD_LEN;
+		for (int j = 0; j < len; j++)
+			vocab[i][j] = 'a' + rng() % 26;
+		vocab[i][len] = '\0';
+		sum += 1.0 / (i + 1);
+		cdf[i] = sum;
+	}
+
+	static char buf[1 << 16];
+	size_t len = 0;
+	uint64_t written = 0;
+	int line = 0;
+	while (written < size) {
+		double u = (rng() >> 11) * (1.0 / (1ULL << 53)) * sum;
+		int lo = 0, hi = nvocab - 1;
+		while (lo < hi) {
+			int mid = (lo + hi) / 2;
+			if (cdf[mid] < u)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+
+		// now and then a capital, some punctuation or a line break
+		uint64_t r = rng();
+		int n = snprintf(buf + len, sizeof(buf) - len, "%s", vocab[lo]);
+		if (r % 16 == 0)
+			buf[len] -= 'a' - 'A';
+		len += n;
+		line += n + 1;
+		if (r % 13 == 0)
+			buf[len++] = ',';
+		if (line > 72) {
+			buf[len++] = '\n';
+			line = 0;
+		} else {
+			buf[len++] = ' ';
+		}
+
+		if (len > sizeof(buf) - MAX_WORD_LEN - 4) {
+			size_t out = written + len > size ? size - written : len;
+			fwrite(buf, 1, out, fp);
+			written += out;
+			len = 0;
+		}
+	}
+
+	free(vocab);
+	free(cdf);
+	if (fclose(fp) != 0) {
+		perror("write output failed");
+		return 1;
+	}
+	return 0;
+}
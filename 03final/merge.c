@@ -0,0 +1,239 @@
+/* streaming merge of the sorted word runs and the top-K query */
+
+#include "merge.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <endian.h>
+
+struct word_run *word_run_new(const char *buf, size_t len)
+{
+	struct word_run *run = malloc(sizeof(struct word_run) + len);
+	if (!run)
+		return NULL;
+	run->next = NULL;
+	run->len = len;
+	memcpy(run->data, buf, len);
+	return run;
+}
+
+void word_merge_init(word_merge_t *m)
+{
+	memset(m, 0, sizeof(word_merge_t));
+	m->runs = calloc(WORD_MERGE_FANIN, sizeof(struct word_run *));
+}
+
+void word_merge_free(word_merge_t *m)
+{
+	for (int i = 0; i < m->nruns; i++)
+		free(m->runs[i]);
+	free(m->runs);
+	m->runs = NULL;
+	m->nruns = 0;
+}
+
+// read position in one run, with its current entry decoded
+struct run_cursor {
+	const struct word_run *run;
+	size_t off;
+	const char *word;
+	int len;
+	uint64_t count;
+};
+
+static int cursor_next(struct run_cursor *c)
+{
+	return word_run_next(c->run->data, c->run->len, &c->off, &c->word, &c->len,
+			&c->count);
+}
+
+static int cursor_less(struct run_cursor *a, struct run_cursor *b)
+{
+	return word_cmp(a->word, a->len, b->word, b->len) < 0;
+}
+
+static void cursor_sift_down(struct run_cursor *heap, int n, int i)
+{
+	for (;;) {
+		int l = 2 * i + 1, r = l + 1, min = i;
+		if (l < n && cursor_less(&heap[l], &heap[min]))
+			min = l;
+		if (r < n && cursor_less(&heap[r], &heap[min]))
+			min = r;
+		if (min == i)
+			return;
+		struct run_cursor tmp = heap[i];
+		heap[i] = heap[min];
+		heap[min] = tmp;
+		i = min;
+	}
+}
+
+int word_merge_walk(word_merge_t *m, word_fn fn, void *arg)
+{
+	struct run_cursor heap[WORD_MERGE_FANIN];
+	int n = 0;
+
+	for (int i = 0; i < m->nruns; i++) {
+		heap[n].run = m->runs[i];
+		heap[n].off = 0;
+		if (cursor_next(&heap[n]) > 0)
+			n++;
+	}
+	for (int i = n / 2 - 1; i >= 0; i--)
+		cursor_sift_down(heap, n, i);
+
+	// pop the smallest word and add up its counts in every run
+	while (n > 0) {
+		char word[WORD_MAX];
+		int len = heap[0].len;
+		uint64_t count = 0;
+		memcpy(word, heap[0].word, len);
+
+		while (n > 0 && word_cmp(heap[0].word, heap[0].len, word, len) == 0) {
+			count += heap[0].count;
+			int ret = cursor_next(&heap[0]);
+			if (ret < 0)
+				return -1;
+			if (ret == 0)
+				heap[0] = heap[--n];
+			cursor_sift_down(heap, n, 0);
+		}
+
+		fn(word, len, count, arg);
+	}
+	return 0;
+}
+
+// the run being built by a compaction
+struct run_builder {
+	char *buf;
+	size_t len, cap;
+	int failed;
+};
+
+static void run_builder_add(const char *word, int len, uint64_t count, void *arg)
+{
+	struct run_builder *b = arg;
+	if (b->len + WORDS_ENTRY_MAX > b->cap) {
+		size_t cap = b->cap ? b->cap * 2 : (1 << 20);
+		char *buf = realloc(b->buf, cap);
+		if (!buf) {
+			b->failed = 1;
+			return;
+		}
+		b->buf = buf;
+		b->cap = cap;
+	}
+
+	count = htobe64(count);
+	b->buf[b->len++] = len;
+	memcpy(b->buf + b->len, word, len);
+	b->len += len;
+	memcpy(b->buf + b->len, &count, sizeof(count));
+	b->len += sizeof(count);
+}
+
+// merge all the runs into one
+static int word_merge_compact(word_merge_t *m)
+{
+	struct run_builder b = { 0 };
+	if (word_merge_walk(m, run_builder_add, &b) < 0 || b.failed) {
+		free(b.buf);
+		return -1;
+	}
+
+	struct word_run *run = word_run_new(b.buf, b.len);
+	free(b.buf);
+	if (!run)
+		return -1;
+
+	for (int i = 0; i < m->nruns; i++)
+		free(m->runs[i]);
+	m->runs[0] = run;
+	m->nruns = 1;
+	return 0;
+}
+
+int word_merge_add(word_merge_t *m, struct word_run *run)
+{
+	if (!m->runs)
+		return -1;
+	if (m->nruns == WORD_MERGE_FANIN && word_merge_compact(m) < 0)
+		return -1;
+
+	m->bytes += run->len;
+	m->runs[m->nruns++] = run;
+	return 0;
+}
+
+int word_top_init(word_top_t *t, int k)
+{
+	t->k = k;
+	t->n = 0;
+	t->heap = malloc(k * sizeof(struct word_top_entry));
+	return t->heap ? 0 : -1;
+}
+
+void word_top_free(word_top_t *t)
+{
+	free(t->heap);
+	t->heap = NULL;
+}
+
+// whether a ranks below b: less frequent, or as frequent and later in order
+static int top_worse(const struct word_top_entry *a, const struct word_top_entry *b)
+{
+	if (a->count != b->count)
+		return a->count < b->count;
+	return word_cmp(a->word, a->len, b->word, b->len) > 0;
+}
+
+void word_top_add(const char *word, int len, uint64_t count, void *arg)
+{
+	word_top_t *t = arg;
+	struct word_top_entry e;
+	memcpy(e.word, word, len);
+	e.len = len;
+	e.count = count;
+
+	int i;
+	if (t->n < t->k) {
+		// sift up from the new leaf
+		i = t->n++;
+		while (i > 0 && top_worse(&e, &t->heap[(i - 1) / 2])) {
+			t->heap[i] = t->heap[(i - 1) / 2];
+			i = (i - 1) / 2;
+		}
+		t->heap[i] = e;
+		return;
+	}
+	if (t->k == 0 || !top_worse(&t->heap[0], &e))
+		return;
+
+	// replace the worst one and sift down
+	i = 0;
+	for (;;) {
+		int c = 2 * i + 1;
+		if (c >= t->n)
+			break;
+		if (c + 1 < t->n && top_worse(&t->heap[c + 1], &t->heap[c]))
+			c += 1;
+		if (!top_worse(&t->heap[c], &e))
+			break;
+		t->heap[i] = t->heap[c];
+		i = c;
+	}
+	t->heap[i] = e;
+}
+
+static int top_entry_cmp(const void *a, const void *b)
+{
+	const struct word_top_entry *x = a, *y = b;
+	return top_worse(x, y) ? 1 : top_worse(y, x) ? -1 : 0;
+}
+
+void word_top_sort(word_top_t *t)
+{
+	qsort(t->heap, t->n, sizeof(struct word_top_entry), top_entry_cmp);
+}
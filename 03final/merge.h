@@ -0,0 +1,58 @@
+#ifndef __MERGE_H__
+#define __MERGE_H__
+
+#include "words.h"
+
+// the runs kept by the master are merged into one once there are this many
+#define WORD_MERGE_FANIN 16
+
+// a sorted run of (word, count) entries as sent by a worker
+struct word_run {
+	struct word_run *next;
+	size_t len;
+	char data[];
+};
+
+struct word_run *word_run_new(const char *buf, size_t len);
+
+// the word counts of all finished jobs, as a bounded number of sorted runs
+typedef struct {
+	struct word_run **runs;
+	int nruns;
+	uint64_t bytes;			// run bytes received, before merging
+} word_merge_t;
+
+void word_merge_init(word_merge_t *m);
+void word_merge_free(word_merge_t *m);
+
+// add a run, which is owned by m from now on; when WORD_MERGE_FANIN runs
+// are kept they are merged into one, so memory stays bounded by the number
+// of distinct words. Returns -1 if out of memory.
+int word_merge_add(word_merge_t *m, struct word_run *run);
+
+typedef void (*word_fn)(const char *word, int len, uint64_t count, void *arg);
+
+// k-way merge of the runs, calling fn once for every distinct word, in
+// word order, with its total count
+int word_merge_walk(word_merge_t *m, word_fn fn, void *arg);
+
+struct word_top_entry {
+	char word[WORD_MAX];
+	int len;
+	uint64_t count;
+};
+
+// the k most frequent words seen, ties broken by word order
+typedef struct {
+	int k, n;
+	struct word_top_entry *heap;	// min-heap, the least frequent on top
+} word_top_t;
+
+int word_top_init(word_top_t *t, int k);
+void word_top_free(word_top_t *t);
+void word_top_add(const char *word, int len, uint64_t count, void *t);
+
+// sort the kept words, most frequent first
+void word_top_sort(word_top_t *t);
+
+#endif
@@ -0,0 +1,147 @@
+/* framing of the master/worker protocol */
+
+#include "proto.h"
+
+#include <errno.h>
+#include <endian.h>
+#include <poll.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+int read_full(int fd, void *buf, size_t len)
+{
+	struct iovec iov = { buf, len };
+	return readv_full(fd, &iov, 1);
+}
+
+// skip the first n bytes of an iovec array, returns the new start of it
+static struct iovec *iov_advance(struct iovec *iov, int *iovcnt, size_t n)
+{
+	while (*iovcnt > 0 && n >= iov->iov_len) {
+		n -= iov->iov_len;
+		iov++;
+		(*iovcnt)--;
+	}
+	if (*iovcnt > 0) {
+		iov->iov_base = (char *)iov->iov_base + n;
+		iov->iov_len -= n;
+	}
+	return iov;
+}
+
+// whether a transfer on fd is retried: it was interrupted, or fd is not
+// blocking and it is waited for until it is ready for events
+static int transfer_again(int fd, short events)
+{
+	if (errno == EINTR)
+		return 1;
+	if (errno != EAGAIN && errno != EWOULDBLOCK)
+		return 0;
+
+	struct pollfd pfd = { fd, events, 0 };
+	while (poll(&pfd, 1, -1) < 0)
+		if (errno != EINTR)
+			return 0;
+	return 1;
+}
+
+int readv_full(int fd, struct iovec *iov, int iovcnt)
+{
+	iov = iov_advance(iov, &iovcnt, 0);
+	while (iovcnt > 0) {
+		ssize_t n = readv(fd, iov, iovcnt);
+		if (n < 0 && transfer_again(fd, POLLIN))
+			continue;
+		if (n <= 0)
+			return -1;
+		iov = iov_advance(iov, &iovcnt, n);
+	}
+	return 0;
+}
+
+int writev_full(int fd, struct iovec *iov, int iovcnt)
+{
+	iov = iov_advance(iov, &iovcnt, 0);
+	while (iovcnt > 0) {
+		ssize_t n = writev(fd, iov, iovcnt);
+		if (n < 0 && transfer_again(fd, POLLOUT))
+			continue;
+		if (n <= 0)
+			return -1;
+		iov = iov_advance(iov, &iovcnt, n);
+	}
+	return 0;
+}
+
+void proto_encode_hdr(struct proto_hdr *hdr, int type, uint32_t job_id, uint64_t len)
+{
+	hdr->magic = htons(PROTO_MAGIC);
+	hdr->version = PROTO_VERSION;
+	hdr->type = type;
+	hdr->job_id = htonl(job_id);
+	hdr->len = htobe64(len);
+}
+
+int proto_decode_hdr(struct proto_hdr *hdr)
+{
+	hdr->magic = ntohs(hdr->magic);
+	hdr->job_id = ntohl(hdr->job_id);
+	hdr->len = be64toh(hdr->len);
+
+	if (hdr->magic != PROTO_MAGIC || hdr->version != PROTO_VERSION)
+		return -1;
+	return 0;
+}
+
+#define PROTO_MAX_IOV 8
+
+int proto_send(int fd, int type, uint32_t job_id, const struct iovec *iov, int iovcnt)
+{
+	struct proto_hdr hdr;
+	struct iovec vec[PROTO_MAX_IOV];
+	uint64_t len = 0;
+
+	if (iovcnt >= PROTO_MAX_IOV)
+		return -1;
+
+	vec[0].iov_base = &hdr;
+	vec[0].iov_len = PROTO_HDR_SIZE;
+	for (int i = 0; i < iovcnt; i++) {
+		vec[i + 1] = iov[i];
+		len += iov[i].iov_len;
+	}
+	proto_encode_hdr(&hdr, type, job_id, len);
+
+	return writev_full(fd, vec, iovcnt + 1);
+}
+
+int proto_recv_hdr(int fd, struct proto_hdr *hdr)
+{
+	if (read_full(fd, hdr, PROTO_HDR_SIZE) < 0)
+		return -1;
+	return proto_decode_hdr(hdr);
+}
+
+void hton64_array(uint64_t *dst, const uint64_t *src, int n)
+{
+	for (int i = 0; i < n; i++)
+		dst[i] = htobe64(src[i]);
+}
+
+void ntoh64_array(uint64_t *dst, const uint64_t *src, int n)
+{
+	for (int i = 0; i < n; i++)
+		dst[i] = be64toh(src[i]);
+}
+
+int proto_skip(int fd, uint64_t len)
+{
+	char buf[4096];
+	while (len > 0) {
+		size_t n = len < sizeof(buf) ? len : sizeof(buf);
+		if (read_full(fd, buf, n) < 0)
+			return -1;
+		len -= n;
+	}
+	return 0;
+}
@@ -0,0 +1,81 @@
+#ifndef __PROTO_H__
+#define __PROTO_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/uio.h>
+
+// Every message between master and worker is a fixed header followed by len
+// bytes of payload, all integers in network byte order. Many jobs may be in
+// flight on one connection, and replies carry the job_id of their request,
+// so they can be matched in any order.
+
+#define PROTO_MAGIC 0x4c43		// "LC"
+#define PROTO_VERSION 1
+
+// longest file path accepted in a job
+#define PROTO_MAX_PATH 4096
+
+enum proto_type {
+	PROTO_COUNT = 1,	// master -> worker: u64 start, u64 end, path
+	PROTO_RESULT,		// worker -> master: u64 counter[26], u64 busy_ns
+	PROTO_ERROR,		// worker -> master: error message
+	PROTO_COUNT_DATA,	// master -> worker: u64 start, u64 end, the bytes of
+						// [start, end) of the file
+	PROTO_WORDS,		// master -> worker: u64 start, u64 end, path
+	PROTO_WORDS_DATA,	// master -> worker: u64 start, u64 end, the bytes of
+						// the range with the context around it, see words.h
+	PROTO_WORD_RUN,		// worker -> master: sorted (word, count) entries
+	PROTO_WORDS_DONE,	// worker -> master: u64 busy_ns, every run of the job
+						// was sent
+	PROTO_CANCEL,		// master -> worker: no payload, job_id is not needed
+						// any more and gets no reply if not started yet
+};
+
+// busy_ns is how long the worker spent on the job, from receiving it to
+// replying; older workers leave it out
+
+struct proto_hdr {
+	uint16_t magic;
+	uint8_t version;
+	uint8_t type;
+	uint32_t job_id;
+	uint64_t len;
+} __attribute__((packed));
+
+#define PROTO_HDR_SIZE sizeof(struct proto_hdr)
+
+// payload of PROTO_COUNT and PROTO_WORDS without the path, and of
+// PROTO_COUNT_DATA and PROTO_WORDS_DATA without the file bytes
+struct proto_count {
+	uint64_t start;
+	uint64_t end;
+} __attribute__((packed));
+
+// send/receive exactly the given bytes, retrying on short transfers and
+// EINTR, and waiting for a non-blocking fd to be ready. Return 0 on success
+// and -1 if the connection fails or is closed.
+int read_full(int fd, void *buf, size_t len);
+int readv_full(int fd, struct iovec *iov, int iovcnt);
+int writev_full(int fd, struct iovec *iov, int iovcnt);
+
+// fill in a header (network byte order) / check and convert a received one,
+// proto_decode_hdr returns -1 if the magic or version does not match
+void proto_encode_hdr(struct proto_hdr *hdr, int type, uint32_t job_id, uint64_t len);
+int proto_decode_hdr(struct proto_hdr *hdr);
+
+// send a message whose payload is gathered from iov[0, iovcnt) with a single
+// writev together with the header
+int proto_send(int fd, int type, uint32_t job_id, const struct iovec *iov, int iovcnt);
+
+// receive and decode the header of the next message
+int proto_recv_hdr(int fd, struct proto_hdr *hdr);
+
+// convert n 64-bit integers to / from network byte order
+void hton64_array(uint64_t *dst, const uint64_t *src, int n);
+void ntoh64_array(uint64_t *dst, const uint64_t *src, int n);
+
+// drop len bytes of payload of a message that is not handled
+int proto_skip(int fd, uint64_t len);
+
+#endif
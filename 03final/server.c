@@ -1,117 +1,1055 @@
 /* server application */
- 
+
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <unistd.h>
- 
-int main(int argc, const char *argv[])
-{
-    uint32_t sock,sock2;
-    struct sockaddr_in wo1,wo2;
-	char path[] = "war_and_peace.txt";
-	char conf[] = "workers.conf";
-	char ip1_buf[50];
-	char ip2_buf[50];
-	uint32_t counter[26];
-	uint32_t counter_buf[26];
-	uint32_t i;
-     
-    // create socket
-    sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock == -1) {
-        printf("Could not create socket");
-    }
-
-	sock2 = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock2 == -1) {
-        printf("Could not create socket");
-    }		
-    printf("Socket created\n");	
-	
-	
-	// read workers' ip
+#include <errno.h>
+#include <time.h>
+#include <endian.h>
+#include <netinet/tcp.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+
+#include "proto.h"
+#include "conn.h"
+#include "merge.h"
+
+#define NLETTERS 26
+#define DEFAULT_PORT 12345
+
+#define DEFAULT_CHUNK_SIZE (16 << 20)
+#define DEFAULT_INFLIGHT 2
+#define MAX_INFLIGHT 256
+
+// seconds a worker may go without any progress while it has work
+#define DEFAULT_TIMEOUT 60
+
+// words printed by a word count, 0 prints every word
+#define DEFAULT_TOP_K 20
+
+// a job is lagging once it has taken this many times the median time per
+// byte of the finished jobs, and gets a backup copy on an idle worker
+#define DEFAULT_SPEC_FACTOR 2.0
+
+// finished jobs needed before the median is trusted
+#define SPEC_MIN_SAMPLES 2
+
+// seconds any job may take before it is considered lagging
+#define SPEC_MIN_LAG 0.01
+
+#define JOB_NONE UINT32_MAX
+
+enum sched_mode { SCHED_STATIC, SCHED_DYNAMIC };
+
+typedef struct {
+	uint64_t start, end;
+} range_t;
+
+enum worker_state { WORKER_CONNECTING, WORKER_READY, WORKER_FAILED };
+
+// a worker from workers.conf, its connection and the ids of the jobs it is
+// working on
+typedef struct {
+	char ip[64];
+	uint16_t port;
+	uint32_t weight;
+	enum worker_state state;
+	conn_t conn;
+	int polling_out;		// EPOLLOUT is registered
+	double deadline;		// given up on if there is no progress by then
+	uint32_t inflight[MAX_INFLIGHT];
+	int count;
+	uint64_t nranges, nbytes;
+	double busy;			// seconds spent on the finished jobs, as reported
+} worker_t;
+
+// every range sent to a worker is a job, its id is the index in the table
+typedef struct {
+	range_t range;
+	worker_t *worker;		// NULL once the job is finished or failed
+	struct word_run *runs;	// word runs received, merged once all are in
+	double sent_at;
+	uint32_t twin;			// the other copy of a range run speculatively
+	int backup;				// the copy started later
+	int cancelled;			// lost the race to its twin
+} job_t;
+
+static struct {
+	job_t *jobs;
+	uint32_t njobs, cap;
+} job_table;
+
+// work not handed out yet: ranges to be redone because their worker failed
+// and, in dynamic mode, the part of the file after cursor
+static struct {
+	enum sched_mode mode;
+	uint64_t chunk_size;
+	int inflight;
+	uint64_t cursor, total_len;
+	range_t *retry;
+	int nretry, retry_cap;
+} sched;
+
+// the file being counted, its bytes are read by the workers from their own
+// copy of path, or shipped to them from fd in data shipping mode; either
+// its letters or its words are counted
+static struct {
+	const char *path;
+	int ship_data;
+	int fd;
+	int words;
+} input;
+
+// the merged counters or word runs and how many bytes of the file they cover
+static struct {
+	uint64_t counter[NLETTERS];
+	word_merge_t words;
+	uint64_t done_len;
+} result;
+
+// seconds from handing out each finished job to its result
+static struct {
+	double *latency;
+	uint32_t n, cap;
+} stats;
+
+// running median of the seconds per byte of the finished jobs: the lower
+// half in a max-heap, the upper half in a min-heap
+static struct {
+	double factor;
+	double *lo, *hi;
+	int nlo, nhi, cap;
+	uint64_t backups, wins;
+} spec;
+
+static int epfd;
+static double timeout = DEFAULT_TIMEOUT;
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// push x on a heap of n values, max-heap if sign is 1 and min-heap if -1
+static void heap_push(double *heap, int n, double x, int sign)
+{
+	int i = n;
+	while (i > 0 && sign * (x - heap[(i - 1) / 2]) > 0) {
+		heap[i] = heap[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	heap[i] = x;
+}
+
+static double heap_pop(double *heap, int n, int sign)
+{
+	double top = heap[0], x = heap[--n];
+	int i = 0;
+	for (;;) {
+		int c = 2 * i + 1;
+		if (c >= n)
+			break;
+		if (c + 1 < n && sign * (heap[c + 1] - heap[c]) > 0)
+			c += 1;
+		if (sign * (heap[c] - x) <= 0)
+			break;
+		heap[i] = heap[c];
+		i = c;
+	}
+	heap[i] = x;
+	return top;
+}
+
+static void median_add(double x)
+{
+	if (spec.nlo + spec.nhi + 1 > spec.cap) {
+		spec.cap = spec.cap ? spec.cap * 2 : 256;
+		spec.lo = realloc(spec.lo, spec.cap * sizeof(double));
+		spec.hi = realloc(spec.hi, spec.cap * sizeof(double));
+	}
+
+	if (spec.nlo == 0 || x <= spec.lo[0])
+		heap_push(spec.lo, spec.nlo++, x, 1);
+	else
+		heap_push(spec.hi, spec.nhi++, x, -1);
+
+	// keep the halves balanced, the lower one may have one more
+	if (spec.nlo > spec.nhi + 1)
+		heap_push(spec.hi, spec.nhi++, heap_pop(spec.lo, spec.nlo--, 1), -1);
+	else if (spec.nhi > spec.nlo)
+		heap_push(spec.lo, spec.nlo++, heap_pop(spec.hi, spec.nhi--, -1), 1);
+}
+
+static double median()
+{
+	if (spec.nlo > spec.nhi)
+		return spec.lo[0];
+	return (spec.lo[0] + spec.hi[0]) / 2;
+}
+
+// parse workers.conf, one worker per line as ip[:port[:weight]]; blank lines
+// and lines starting with '#' are skipped. Returns the number of workers.
+static int read_workers(const char *conf, worker_t **workers)
+{
 	FILE *confp = fopen(conf, "r");
-	fscanf(confp,"%s\n%s", ip1_buf, ip2_buf);
+	if (!confp) {
+		perror("open workers.conf failed");
+		return -1;
+	}
+
+	char line[256];
+	int n = 0, cap = 0;
+	*workers = NULL;
+	while (fgets(line, sizeof(line), confp)) {
+		char *p = line + strspn(line, " \t");
+		p[strcspn(p, "\r\n")] = '\0';
+		if (*p == '\0' || *p == '#')
+			continue;
+
+		if (n == cap) {
+			cap = cap ? cap * 2 : 8;
+			*workers = realloc(*workers, cap * sizeof(worker_t));
+		}
+
+		worker_t *w = &(*workers)[n];
+		memset(w, 0, sizeof(worker_t));
+		w->port = DEFAULT_PORT;
+		w->weight = 1;
+		w->conn.fd = -1;
+
+		char *port = strchr(p, ':');
+		if (port) {
+			*port++ = '\0';
+			char *weight = strchr(port, ':');
+			if (weight) {
+				*weight++ = '\0';
+				w->weight = strtoul(weight, NULL, 10);
+			}
+			if (*port)
+				w->port = atoi(port);
+		}
+		snprintf(w->ip, sizeof(w->ip), "%s", p);
+
+		if (inet_addr(w->ip) == INADDR_NONE) {
+			fprintf(stderr, "invalid worker address '%s', skip it\n", w->ip);
+			continue;
+		}
+		if (w->weight == 0)
+			continue;
+		n += 1;
+	}
+
 	fclose(confp);
-	printf("ip %s , %s \n", ip1_buf, ip2_buf);
-
-	
-	// read file and decide the work assignment
-	FILE *fp = fopen(path, "r");
-	fseek(fp,0,SEEK_END);
-	uint32_t total_len = ftell(fp);
-	printf("total_len : %d\n", total_len);
-	    
-	fclose(fp);
-	
-	uint32_t half_len = htonl(total_len/2);
-	total_len = htonl(total_len);
-	uint32_t trash = htonl(0);
-	
-	uint32_t len_message = sizeof(path) + 8;
-	len_message = htonl(len_message);	
-
-	
-	// start to connect
-    wo1.sin_addr.s_addr = inet_addr(ip1_buf);
-    wo1.sin_family = AF_INET;
-    wo1.sin_port = htons( 12345 );
-
-
-    // connect to remote worker1
-    if (connect(sock, (struct sockaddr *)&wo1, sizeof(wo1)) < 0) {
-        perror("connect failed. Error");
-        return 1;
-    }
-	
-	wo2.sin_addr.s_addr = inet_addr(ip2_buf);
-    wo2.sin_family = AF_INET;
-    wo2.sin_port = htons( 12345 );
- 
-    // connect to remote worker2
-    if (connect(sock2, (struct sockaddr *)&wo2, sizeof(wo2)) < 0) {
-        perror("connect failed. Error");
-        return 1;
-    }
-     
-    printf("Connected\n");
-	
-	// assign counting work
-    send(sock, &len_message, 4, 0);
-	send(sock, path, sizeof(path), 0);
-	send(sock, &trash, 4, 0);
-	send(sock, &half_len, 4, 0);
-	
-	send(sock2, &len_message, 4, 0);
-	send(sock2, path, sizeof(path), 0);
-	send(sock2, &half_len, 4, 0);
-	send(sock2, &total_len, 4, 0);	
-	
-	
-	// receive counting result	
-	recv(sock, counter_buf, 104, 0);
-	for(i = 0; i < 26; i++)
-		counter[i] = 0;	
-	for(i = 0; i < 26; i++)
-		counter[i] += ntohl(counter_buf[i]);
-	printf("worker1 finished !!!\n");
-
-	close(sock);
-	
-	recv(sock2, counter_buf, 104, 0);
-	for(i = 0; i < 26; i++)
-		counter[i] += ntohl(counter_buf[i]);
-	printf("worker2 finished !!!\n");	
-	
-	close(sock2);
-     
-    
+	return n;
+}
+
+// parse a byte count with an optional K, M or G suffix
+static uint64_t parse_size(const char *str)
+{
+	char *end;
+	uint64_t size = strtoull(str, &end, 0);
+	switch (*end) {
+		case 'g': case 'G': size <<= 10;
+		case 'm': case 'M': size <<= 10;
+		case 'k': case 'K': size <<= 10;
+	}
+	return size;
+}
+
+static void sched_retry(range_t r)
+{
+	if (sched.nretry == sched.retry_cap) {
+		sched.retry_cap = sched.retry_cap ? sched.retry_cap * 2 : 16;
+		sched.retry = realloc(sched.retry, sched.retry_cap * sizeof(range_t));
+	}
+	sched.retry[sched.nretry++] = r;
+}
+
+// take the next range to hand out, returns 0 if there is none
+static int sched_next(range_t *r)
+{
+	if (sched.nretry > 0) {
+		*r = sched.retry[--sched.nretry];
+		return 1;
+	}
+
+	if (sched.mode == SCHED_DYNAMIC && sched.cursor < sched.total_len) {
+		r->start = sched.cursor;
+		r->end = sched.cursor + sched.chunk_size;
+		if (r->end > sched.total_len)
+			r->end = sched.total_len;
+		sched.cursor = r->end;
+		return 1;
+	}
+
+	return 0;
+}
+
+// watch the worker's socket for input, and for output while anything is
+// queued on it
+static void worker_update_events(worker_t *w)
+{
+	int want_out = w->state == WORKER_CONNECTING || conn_want_write(&w->conn);
+	if (want_out == w->polling_out)
+		return;
+
+	struct epoll_event ev = { .events = EPOLLIN | (want_out ? EPOLLOUT : 0),
+		.data.ptr = w };
+	epoll_ctl(epfd, EPOLL_CTL_MOD, w->conn.fd, &ev);
+	w->polling_out = want_out;
+}
+
+// forget the word runs of a job that has to be redone
+static void job_drop_runs(job_t *job)
+{
+	while (job->runs) {
+		struct word_run *run = job->runs;
+		job->runs = run->next;
+		free(run);
+	}
+}
+
+// hand the range of a failed job out again, unless its twin is still on it
+static void job_give_back(job_t *job)
+{
+	job_drop_runs(job);
+	if (job->twin != JOB_NONE) {
+		job_table.jobs[job->twin].twin = JOB_NONE;
+		job->twin = JOB_NONE;
+		return;
+	}
+	sched_retry(job->range);
+}
+
+// give back the ranges of a failed worker and stop using it
+static void worker_fail(worker_t *w, const char *what)
+{
+	fprintf(stderr, "%s worker %s:%d failed, its %d ranges are reassigned\n",
+			what, w->ip, w->port, w->count);
+
+	for (int i = 0; i < w->count; i++) {
+		job_t *job = &job_table.jobs[w->inflight[i]];
+		job->worker = NULL;
+		job_give_back(job);
+	}
+	w->count = 0;
+
+	conn_close(&w->conn);
+	w->state = WORKER_FAILED;
+}
+
+// write what the socket takes of the worker's queue
+static void worker_flush(worker_t *w)
+{
+	uint64_t sent = w->conn.bytes_out;
+	if (conn_flush(&w->conn) < 0) {
+		worker_fail(w, "assign work to");
+		return;
+	}
+	// a worker still taking in shipped data is making progress
+	if (w->conn.bytes_out != sent)
+		w->deadline = now() + timeout;
+	worker_update_events(w);
+}
+
+// assign counting work: start and end point, followed by the file path or,
+// when shipping data, by the bytes of the range. Words are counted where
+// they start, so a word counting job ships the bytes around the range too.
+static int send_job(worker_t *w, range_t r)
+{
+	if (job_table.njobs == job_table.cap) {
+		job_table.cap = job_table.cap ? job_table.cap * 2 : 256;
+		job_table.jobs = realloc(job_table.jobs, job_table.cap * sizeof(job_t));
+	}
+	uint32_t id = job_table.njobs;
+
+	struct proto_count job = { htobe64(r.start), htobe64(r.end) };
+	struct iovec iov[2] = { { &job, sizeof(job) },
+		{ (void *)input.path, strlen(input.path) } };
+	int ret;
+	if (input.ship_data && input.words) {
+		uint64_t start = words_scan_start(r.start);
+		uint64_t end = words_scan_end(r.end, sched.total_len);
+		ret = conn_queue(&w->conn, PROTO_WORDS_DATA, id, iov, 1,
+				input.fd, start, end - start);
+	} else if (input.ship_data) {
+		ret = conn_queue(&w->conn, PROTO_COUNT_DATA, id, iov, 1,
+				input.fd, r.start, r.end - r.start);
+	} else {
+		ret = conn_queue(&w->conn, input.words ? PROTO_WORDS : PROTO_COUNT, id,
+				iov, 2, -1, 0, 0);
+	}
+	if (ret < 0)
+		return -1;
+
+	job_table.jobs[id].range = r;
+	job_table.jobs[id].worker = w;
+	job_table.jobs[id].runs = NULL;
+	job_table.jobs[id].sent_at = now();
+	job_table.jobs[id].twin = JOB_NONE;
+	job_table.jobs[id].backup = 0;
+	job_table.jobs[id].cancelled = 0;
+	job_table.njobs += 1;
+
+	if (w->count == 0)
+		w->deadline = now() + timeout;
+	w->inflight[w->count++] = id;
+	return 0;
+}
+
+// the job id the worker is working on, NULL for a stale or bogus id
+static job_t *worker_job(worker_t *w, uint32_t id)
+{
+	if (id >= job_table.njobs || job_table.jobs[id].worker != w)
+		return NULL;
+	return &job_table.jobs[id];
+}
+
+// take job id off the worker's list, returns NULL if the worker is not
+// working on it
+static job_t *worker_finish_job(worker_t *w, uint32_t id)
+{
+	if (!worker_job(w, id))
+		return NULL;
+
+	for (int i = 0; i < w->count; i++) {
+		if (w->inflight[i] == id) {
+			w->inflight[i] = w->inflight[--w->count];
+			break;
+		}
+	}
+
+	job_t *job = &job_table.jobs[id];
+	job->worker = NULL;
+	return job;
+}
+
+// keep up to sched.inflight jobs queued on the worker
+static void worker_refill(worker_t *w)
+{
+	range_t r;
+	int queued = 0;
+	while (w->state == WORKER_READY && w->count < sched.inflight && sched_next(&r)) {
+		if (send_job(w, r) < 0) {
+			sched_retry(r);
+			worker_fail(w, "assign work to");
+			return;
+		}
+		queued = 1;
+	}
+	if (queued)
+		worker_flush(w);
+}
+
+// withdraw a job that lost the race to its twin: unqueue it if the worker
+// has not got it yet, or tell the worker to drop it
+static void job_cancel(uint32_t id)
+{
+	job_t *job = &job_table.jobs[id];
+	worker_t *w = job->worker;
+	if (!w)
+		return;
+
+	worker_finish_job(w, id);
+	job_drop_runs(job);
+	job->twin = JOB_NONE;
+	job->cancelled = 1;
+
+	if (conn_unqueue(&w->conn, id) == 0 &&
+			conn_queue(&w->conn, PROTO_CANCEL, id, NULL, 0, -1, 0, 0) < 0) {
+		worker_fail(w, "cancel job on");
+		return;
+	}
+	worker_flush(w);
+}
+
+// account for a finished job the worker was busy with for busy_ns, the
+// first copy of a range to finish wins and the other one is cancelled
+static void job_done(worker_t *w, job_t *job, uint64_t busy_ns)
+{
+	uint64_t len = job->range.end - job->range.start;
+	w->nranges += 1;
+	w->nbytes += len;
+	w->busy += busy_ns / 1e9;
+	result.done_len += len;
+
+	if (stats.n == stats.cap) {
+		stats.cap = stats.cap ? stats.cap * 2 : 256;
+		stats.latency = realloc(stats.latency, stats.cap * sizeof(double));
+	}
+	double latency = now() - job->sent_at;
+	stats.latency[stats.n++] = latency;
+	median_add(latency / len);
+
+	if (job->twin != JOB_NONE) {
+		uint32_t twin = job->twin;
+		job->twin = JOB_NONE;
+		spec.wins += job->backup;
+		job_cancel(twin);
+	}
+}
+
+// complain about a reply to a job the worker does not have, unless the job
+// was cancelled and the reply merely crossed the cancel on the wire
+static void unknown_job(worker_t *w, uint32_t id)
+{
+	if (id < job_table.njobs && job_table.jobs[id].cancelled)
+		return;
+	fprintf(stderr, "worker %s:%d replied to unknown job %u\n", w->ip, w->port, id);
+}
+
+// busy_ns of a reply, the u64 at payload[off] if the worker sent it
+static uint64_t reply_busy_ns(struct proto_hdr *hdr, char *payload, size_t off)
+{
+	uint64_t busy = 0;
+	if (hdr->len >= off + sizeof(busy)) {
+		memcpy(&busy, payload + off, sizeof(busy));
+		busy = be64toh(busy);
+	}
+	return busy;
+}
+
+// handle one message of the worker, returns -1 if the worker failed
+static int handle_reply(worker_t *w, struct proto_hdr *hdr, char *payload)
+{
+	job_t *job;
+
+	switch (hdr->type) {
+		case PROTO_RESULT: {
+			uint64_t counter_buf[NLETTERS];
+			if (hdr->len < sizeof(counter_buf)) {
+				worker_fail(w, "receive result from");
+				return -1;
+			}
+
+			job = worker_finish_job(w, hdr->job_id);
+			if (!job) {
+				unknown_job(w, hdr->job_id);
+				return 0;
+			}
+
+			// merge the result as soon as it lands
+			memcpy(counter_buf, payload, sizeof(counter_buf));
+			ntoh64_array(counter_buf, counter_buf, NLETTERS);
+			for (int l = 0; l < NLETTERS; l++)
+				result.counter[l] += counter_buf[l];
+
+			job_done(w, job, reply_busy_ns(hdr, payload, sizeof(counter_buf)));
+			return 0;
+		}
+		case PROTO_WORD_RUN: {
+			// runs are kept with the job until it is done, so a job redone
+			// after a failure is never counted twice
+			job = worker_job(w, hdr->job_id);
+			if (!job)
+				return 0;
+
+			struct word_run *run;
+			if (word_run_check(payload, hdr->len) < 0 ||
+					!(run = word_run_new(payload, hdr->len))) {
+				worker_fail(w, "receive words from");
+				return -1;
+			}
+			run->next = job->runs;
+			job->runs = run;
+			return 0;
+		}
+		case PROTO_WORDS_DONE: {
+			job = worker_finish_job(w, hdr->job_id);
+			if (!job) {
+				unknown_job(w, hdr->job_id);
+				return 0;
+			}
+
+			while (job->runs) {
+				struct word_run *run = job->runs;
+				job->runs = run->next;
+				if (word_merge_add(&result.words, run) < 0) {
+					fprintf(stderr, "out of memory merging words\n");
+					exit(1);
+				}
+			}
+
+			job_done(w, job, reply_busy_ns(hdr, payload, 0));
+			return 0;
+		}
+		case PROTO_ERROR: {
+			int n = hdr->len < 512 ? hdr->len : 512;
+			fprintf(stderr, "worker %s:%d: %.*s\n", w->ip, w->port, n, payload);
+
+			// most likely the worker could not read the file, so its other
+			// jobs are moved as well
+			job = worker_finish_job(w, hdr->job_id);
+			if (job)
+				job_give_back(job);
+			worker_fail(w, "counting on");
+			return -1;
+		}
+		default:
+			return 0;
+	}
+}
+
+// read what the worker sent and handle every complete message
+static void worker_read(worker_t *w)
+{
+	struct proto_hdr hdr;
+	char *payload;
+	int ret;
+
+	if (conn_fill(&w->conn) < 0) {
+		worker_fail(w, "receive result from");
+		return;
+	}
+
+	while ((ret = conn_peek(&w->conn, &hdr, &payload)) > 0) {
+		w->deadline = now() + timeout;
+		if (handle_reply(w, &hdr, payload) < 0)
+			return;
+		conn_consume(&w->conn, &hdr);
+	}
+	if (ret < 0)
+		worker_fail(w, "receive result from");
+}
+
+// start a non-blocking connect to the worker
+static void worker_connect(worker_t *w)
+{
+	struct sockaddr_in addr;
+	addr.sin_addr.s_addr = inet_addr(w->ip);
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(w->port);
+
+	int sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	conn_init(&w->conn, sock);
+	if (sock < 0 || (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 &&
+				errno != EINPROGRESS)) {
+		worker_fail(w, "connect to");
+		return;
+	}
+
+	int on = 1;
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+	w->state = WORKER_CONNECTING;
+	w->deadline = now() + timeout;
+	w->polling_out = 1;
+	struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT, .data.ptr = w };
+	epoll_ctl(epfd, EPOLL_CTL_ADD, sock, &ev);
+}
+
+// the socket of a connecting worker became writable
+static void worker_connected(worker_t *w)
+{
+	int err = 0;
+	socklen_t len = sizeof(err);
+	if (getsockopt(w->conn.fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err) {
+		errno = err;
+		fprintf(stderr, "connect to worker %s:%d failed: %s\n", w->ip, w->port,
+				strerror(err));
+		worker_fail(w, "connect to");
+		return;
+	}
+
+	w->state = WORKER_READY;
+	worker_update_events(w);
+	printf("worker %s:%d connected\n", w->ip, w->port);
+}
+
+// statically partition the file among the connected workers in proportion
+// to their weights
+static void assign_static(worker_t *workers, int nworkers)
+{
+	uint64_t total_weight = 0, acc_weight = 0;
+	for (int i = 0; i < nworkers; i++)
+		if (workers[i].state == WORKER_READY)
+			total_weight += workers[i].weight;
+
+	for (int i = 0; i < nworkers; i++) {
+		worker_t *w = &workers[i];
+		if (w->state != WORKER_READY)
+			continue;
+
+		range_t r;
+		r.start = sched.total_len * acc_weight / total_weight;
+		acc_weight += w->weight;
+		r.end = sched.total_len * acc_weight / total_weight;
+
+		printf("worker %s:%d : [%lu, %lu)\n", w->ip, w->port, r.start, r.end);
+		if (send_job(w, r) < 0) {
+			sched_retry(r);
+			worker_fail(w, "assign work to");
+			continue;
+		}
+		worker_flush(w);
+	}
+}
+
+// once nothing else is left to hand out, start a backup copy of the job
+// furthest behind the median on every idle worker. Returns when the next
+// job will be lagging.
+static double speculate(worker_t *workers, int nworkers)
+{
+	double t = now(), next = t + timeout;
+	if (spec.factor <= 0 || spec.nlo + spec.nhi < SPEC_MIN_SAMPLES || sched.nretry > 0 ||
+			(sched.mode == SCHED_DYNAMIC && sched.cursor < sched.total_len))
+		return next;
+	double limit = spec.factor * median();
+
+	for (int i = 0; i < nworkers; i++) {
+		worker_t *idle = &workers[i];
+		if (idle->state != WORKER_READY || idle->count > 0)
+			continue;
+
+		uint32_t lagging = JOB_NONE;
+		double worst = 1;
+		for (int j = 0; j < nworkers; j++) {
+			worker_t *w = &workers[j];
+			for (int k = 0; w != idle && k < w->count; k++) {
+				job_t *job = &job_table.jobs[w->inflight[k]];
+				if (job->twin != JOB_NONE)
+					continue;
+
+				double due = limit * (job->range.end - job->range.start);
+				if (due < SPEC_MIN_LAG)
+					due = SPEC_MIN_LAG;
+				double lag = (t - job->sent_at) / due;
+				if (lag > worst) {
+					worst = lag;
+					lagging = w->inflight[k];
+				} else if (job->sent_at + due < next) {
+					next = job->sent_at + due;
+				}
+			}
+		}
+		if (lagging == JOB_NONE)
+			break;
+
+		range_t r = job_table.jobs[lagging].range;
+		if (send_job(idle, r) < 0) {
+			worker_fail(idle, "assign work to");
+			continue;
+		}
+		uint32_t backup = job_table.njobs - 1;
+		job_table.jobs[lagging].twin = backup;
+		job_table.jobs[backup].twin = lagging;
+		job_table.jobs[backup].backup = 1;
+		spec.backups += 1;
+
+		worker_t *slow = job_table.jobs[lagging].worker;
+		printf("range [%lu, %lu) on %s:%d is lagging, backup on %s:%d\n", r.start, r.end,
+				slow->ip, slow->port, idle->ip, idle->port);
+		worker_flush(idle);
+	}
+	return next;
+}
+
+// totals of the merged word counts, with the most frequent words kept in
+// top or, without it, every word printed in order
+struct word_report {
+	uint64_t words, distinct;
+	word_top_t *top;
+};
+
+static void report_word(const char *word, int len, uint64_t count, void *arg)
+{
+	struct word_report *rep = arg;
+	rep->words += count;
+	rep->distinct += 1;
+	if (rep->top)
+		word_top_add(word, len, count, rep->top);
+	else
+		printf("%.*s , %lu \n", len, word, count);
+}
+
+static int print_words(int top_k)
+{
+	word_top_t top;
+	struct word_report rep = { 0, 0, top_k > 0 ? &top : NULL };
+
+	if (top_k > 0 && word_top_init(&top, top_k) < 0)
+		return -1;
+	if (word_merge_walk(&result.words, report_word, &rep) < 0)
+		return -1;
+
+	if (top_k > 0) {
+		word_top_sort(&top);
+		for (int i = 0; i < top.n; i++)
+			printf("%.*s , %lu \n", top.heap[i].len, top.heap[i].word, top.heap[i].count);
+		word_top_free(&top);
+	}
+	printf("total words : %lu, distinct words : %lu, run bytes received : %lu\n",
+			rep.words, rep.distinct, result.words.bytes);
+	return 0;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return x < y ? -1 : x > y;
+}
+
+// nearest rank percentile of the job latencies, sorted in place
+static double latency_percentile(double p)
+{
+	if (stats.n == 0)
+		return 0;
+	qsort(stats.latency, stats.n, sizeof(double), cmp_double);
+	uint32_t rank = p * stats.n + 0.5;
+	return stats.latency[rank ? rank - 1 : 0];
+}
+
+// append the measurements of this run to path as one line of json
+static int write_report(const char *path, worker_t *workers, int nworkers, double elapsed)
+{
+	FILE *fp = fopen(path, "a");
+	if (!fp)
+		return -1;
+
+	uint64_t bytes_in = 0, bytes_out = 0;
+	for (int i = 0; i < nworkers; i++) {
+		bytes_in += workers[i].conn.bytes_in;
+		bytes_out += workers[i].conn.bytes_out;
+	}
+
+	fprintf(fp, "{\"count\":\"%s\",\"mode\":\"%s\",\"ship_data\":%d,"
+			"\"chunk_size\":%lu,\"inflight\":%d,\"workers\":%d,\"bytes\":%lu,"
+			"\"seconds\":%.6f,\"gbps\":%.4f,\"jobs\":%u,"
+			"\"latency_p50_ms\":%.3f,\"latency_p99_ms\":%.3f,"
+			"\"net_bytes_out\":%lu,\"net_bytes_in\":%lu,\"worker_stats\":[",
+			input.words ? "words" : "letters",
+			sched.mode == SCHED_STATIC ? "static" : "dynamic", input.ship_data,
+			sched.chunk_size, sched.inflight, nworkers, sched.total_len, elapsed,
+			elapsed > 0 ? sched.total_len / elapsed / 1e9 : 0.0, stats.n,
+			latency_percentile(0.50) * 1e3, latency_percentile(0.99) * 1e3,
+			bytes_out, bytes_in);
+	for (int i = 0; i < nworkers; i++) {
+		worker_t *w = &workers[i];
+		fprintf(fp, "%s{\"addr\":\"%s:%d\",\"ranges\":%lu,\"bytes\":%lu,"
+				"\"busy_s\":%.6f,\"net_bytes_out\":%lu,\"net_bytes_in\":%lu}",
+				i ? "," : "", w->ip, w->port, w->nranges, w->nbytes, w->busy,
+				w->conn.bytes_out, w->conn.bytes_in);
+	}
+	fprintf(fp, "]}\n");
+
+	return fclose(fp);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *conf = "workers.conf";
+	const char *report = NULL;
+	worker_t *workers;
+	int top_k = DEFAULT_TOP_K;
+	int i, opt;
+
+	input.path = "war_and_peace.txt";
+	sched.mode = SCHED_STATIC;
+	sched.chunk_size = DEFAULT_CHUNK_SIZE;
+	sched.inflight = DEFAULT_INFLIGHT;
+	spec.factor = DEFAULT_SPEC_FACTOR;
+	word_merge_init(&result.words);
+
+	while ((opt = getopt(argc, argv, "c:dJ:k:m:s:S:q:T:w")) != -1) {
+		switch (opt) {
+			case 'c':
+				conf = optarg;
+				break;
+			case 'd':
+				input.ship_data = 1;
+				break;
+			case 'm':
+				if (strcmp(optarg, "static") == 0)
+					sched.mode = SCHED_STATIC;
+				else if (strcmp(optarg, "dynamic") == 0)
+					sched.mode = SCHED_DYNAMIC;
+				else {
+					fprintf(stderr, "unknown scheduling mode %s\n", optarg);
+					return 1;
+				}
+				break;
+			case 's':
+				sched.chunk_size = parse_size(optarg);
+				break;
+			case 'q':
+				sched.inflight = atoi(optarg);
+				break;
+			case 'T':
+				timeout = atof(optarg);
+				break;
+			case 'w':
+				input.words = 1;
+				break;
+			case 'J':
+				report = optarg;
+				break;
+			case 'S':
+				spec.factor = atof(optarg);
+				break;
+			case 'k':
+				top_k = atoi(optarg);
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-c workers.conf] [-d] [-m static|dynamic] "
+						"[-s chunk_size] [-q inflight] [-T timeout] [-S spec_factor] "
+						"[-w [-k top]] [-J report.json] [file]\n", argv[0]);
+				return 1;
+		}
+	}
+	if (optind < argc)
+		input.path = argv[optind];
+	if (sched.chunk_size == 0 || sched.inflight < 1 || sched.inflight > MAX_INFLIGHT) {
+		fprintf(stderr, "chunk size must be positive and inflight in [1, %d]\n",
+				MAX_INFLIGHT);
+		return 1;
+	}
+
+
+	// read workers' ip
+	int nworkers = read_workers(conf, &workers);
+	if (nworkers <= 0) {
+		fprintf(stderr, "no worker found in %s\n", conf);
+		return 1;
+	}
+
+
+	// read file size
+	input.fd = open(input.path, O_RDONLY);
+	struct stat st;
+	if (input.fd < 0 || fstat(input.fd, &st) < 0) {
+		perror("open file failed");
+		return 1;
+	}
+	uint64_t total_len = st.st_size;
+	if (!input.ship_data) {
+		close(input.fd);
+		input.fd = -1;
+	}
+	printf("total_len : %lu\n", total_len);
+	sched.total_len = total_len;
+
+
+	// connect to all the workers at once
+	double started = now();
+	epfd = epoll_create1(0);
+	if (epfd < 0) {
+		perror("epoll_create failed");
+		return 1;
+	}
+	for (i = 0; i < nworkers; i++)
+		worker_connect(&workers[i]);
+
+
+	// drive all the connections until every byte is counted: static mode
+	// partitions the file once every connect has finished, dynamic mode
+	// hands out chunks to whichever worker has a free slot
+	int assigned = 0;
+	struct epoll_event events[64];
+	while (result.done_len < total_len) {
+		double spec_wake = now() + timeout;
+		int connecting = 0, ready = 0;
+		for (i = 0; i < nworkers; i++) {
+			connecting += workers[i].state == WORKER_CONNECTING;
+			ready += workers[i].state == WORKER_READY;
+		}
+
+		if (!connecting) {
+			if (!ready) {
+				fprintf(stderr, "all workers failed, %lu bytes left uncounted\n",
+						total_len - result.done_len);
+				return 1;
+			}
+			if (!assigned && sched.mode == SCHED_STATIC)
+				assign_static(workers, nworkers);
+			assigned = 1;
+
+			// this also moves the ranges of failed workers to others
+			for (i = 0; i < nworkers; i++)
+				worker_refill(&workers[i]);
+			spec_wake = speculate(workers, nworkers);
+		}
+
+		// wake up in time for the earliest deadline or lagging job
+		double t = now(), wake = spec_wake;
+		for (i = 0; i < nworkers; i++) {
+			worker_t *w = &workers[i];
+			if ((w->state == WORKER_CONNECTING || w->count > 0) && w->deadline < wake)
+				wake = w->deadline;
+		}
+		int wait_ms = wake > t ? (int)((wake - t) * 1000) + 1 : 0;
+
+		int n = epoll_wait(epfd, events, 64, wait_ms);
+		if (n < 0 && errno != EINTR) {
+			perror("epoll_wait failed");
+			return 1;
+		}
+
+		for (int e = 0; e < n; e++) {
+			worker_t *w = events[e].data.ptr;
+			if (w->state == WORKER_CONNECTING) {
+				worker_connected(w);
+				continue;
+			}
+			if (w->state == WORKER_READY && (events[e].events & (EPOLLIN | EPOLLERR | EPOLLHUP)))
+				worker_read(w);
+			if (w->state == WORKER_READY && (events[e].events & EPOLLOUT))
+				worker_flush(w);
+		}
+
+		t = now();
+		for (i = 0; i < nworkers; i++) {
+			worker_t *w = &workers[i];
+			if ((w->state == WORKER_CONNECTING || w->count > 0) && t > w->deadline)
+				worker_fail(w, "timeout on");
+		}
+	}
+
+	double elapsed = now() - started;
+
+	for (i = 0; i < nworkers; i++) {
+		worker_t *w = &workers[i];
+		if (w->state != WORKER_READY)
+			continue;
+		printf("worker %s:%d finished %lu ranges, %lu bytes, busy %.3f s !!!\n",
+				w->ip, w->port, w->nranges, w->nbytes, w->busy);
+		conn_close(&w->conn);
+	}
+	printf("%lu bytes in %.3f s, %.3f GB/s\n", total_len, elapsed,
+			elapsed > 0 ? total_len / elapsed / 1e9 : 0.0);
+	if (spec.backups > 0)
+		printf("%lu backup jobs started, %lu finished first\n", spec.backups, spec.wins);
+	if (report && write_report(report, workers, nworkers, elapsed) != 0)
+		perror("write report failed");
+	close(epfd);
+	free(workers);
+	free(stats.latency);
+	free(spec.lo);
+	free(spec.hi);
+	free(sched.retry);
+	free(job_table.jobs);
+	if (input.fd >= 0)
+		close(input.fd);
+
+
 	// print counting result
-	for(i = 0; i < 26; i++)
-		printf("%c , %d \n", i + 'a', counter[i]);
+	if (input.words) {
+		if (print_words(top_k) < 0) {
+			fprintf(stderr, "merging words failed\n");
+			return 1;
+		}
+	} else {
+		for (i = 0; i < NLETTERS; i++)
+			printf("%c , %lu \n", i + 'a', result.counter[i]);
+	}
+	word_merge_free(&result.words);
 
 
-    return 0;
+	return 0;
 }
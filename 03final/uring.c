@@ -0,0 +1,133 @@
+/* io_uring through the raw system calls, no liburing needed */
+
+#include "uring.h"
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+		unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+int uring_init(uring_t *u, unsigned entries)
+{
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	memset(u, 0, sizeof(uring_t));
+
+	u->fd = sys_io_uring_setup(entries, &p);
+	if (u->fd < 0)
+		return -1;
+
+	u->sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	u->cq_ring_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	u->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	// both rings share one mapping on kernels that support it
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (u->cq_ring_len > u->sq_ring_len)
+			u->sq_ring_len = u->cq_ring_len;
+		u->cq_ring_len = 0;
+	}
+
+	u->sq_ring = mmap(NULL, u->sq_ring_len, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	u->cq_ring = u->cq_ring_len == 0 ? u->sq_ring
+		: mmap(NULL, u->cq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+				u->fd, IORING_OFF_CQ_RING);
+	u->sqes = mmap(NULL, u->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			u->fd, IORING_OFF_SQES);
+	if (u->sq_ring == MAP_FAILED || u->cq_ring == MAP_FAILED || u->sqes == MAP_FAILED) {
+		int err = errno;
+		uring_exit(u);
+		errno = err;
+		return -1;
+	}
+
+	char *sq = u->sq_ring, *cq = u->cq_ring;
+	u->sq_head = (unsigned *)(sq + p.sq_off.head);
+	u->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	u->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	u->sq_array = (unsigned *)(sq + p.sq_off.array);
+	u->cq_head = (unsigned *)(cq + p.cq_off.head);
+	u->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	u->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	return 0;
+}
+
+void uring_exit(uring_t *u)
+{
+	if (u->sqes && u->sqes != MAP_FAILED)
+		munmap(u->sqes, u->sqes_len);
+	if (u->cq_ring && u->cq_ring != MAP_FAILED && u->cq_ring != u->sq_ring)
+		munmap(u->cq_ring, u->cq_ring_len);
+	if (u->sq_ring && u->sq_ring != MAP_FAILED)
+		munmap(u->sq_ring, u->sq_ring_len);
+	if (u->fd >= 0)
+		close(u->fd);
+	memset(u, 0, sizeof(uring_t));
+	u->fd = -1;
+}
+
+int uring_prep_read(uring_t *u, int fd, void *buf, unsigned len, uint64_t off,
+		uint64_t data)
+{
+	unsigned tail = *u->sq_tail;
+	unsigned head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+	if (tail - head > *u->sq_mask)
+		return -1;
+
+	unsigned i = tail & *u->sq_mask;
+	struct io_uring_sqe *sqe = &u->sqes[i];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = fd;
+	sqe->addr = (uint64_t)(uintptr_t)buf;
+	sqe->len = len;
+	sqe->off = off;
+	sqe->user_data = data;
+	u->sq_array[i] = i;
+
+	// the kernel may only see the sqe once it is complete
+	__atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	u->queued += 1;
+	return 0;
+}
+
+int uring_submit(uring_t *u, unsigned wait)
+{
+	for (;;) {
+		int ret = sys_io_uring_enter(u->fd, u->queued, wait,
+				wait ? IORING_ENTER_GETEVENTS : 0);
+		if (ret >= 0) {
+			u->queued -= ret;
+			return 0;
+		}
+		if (errno != EINTR)
+			return -1;
+	}
+}
+
+int uring_reap(uring_t *u, uint64_t *data, int *res)
+{
+	unsigned head = *u->cq_head;
+	if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE))
+		return 0;
+
+	struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+	*data = cqe->user_data;
+	*res = cqe->res;
+	__atomic_store_n(u->cq_head, head + 1, __ATOMIC_RELEASE);
+	return 1;
+}
@@ -0,0 +1,37 @@
+#ifndef __URING_H__
+#define __URING_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <linux/io_uring.h>
+
+// a minimal io_uring driven with the raw system calls, enough to keep a
+// queue of reads in flight
+typedef struct {
+	int fd;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_len, cq_ring_len, sqes_len;
+	unsigned queued;		// sqes filled in but not submitted yet
+} uring_t;
+
+// set up a ring of at least entries sqes, returns -1 with errno set if
+// io_uring is not available
+int uring_init(uring_t *u, unsigned entries);
+void uring_exit(uring_t *u);
+
+// queue a read of len bytes at off of fd into buf, completed with data;
+// returns -1 if the submission queue is full
+int uring_prep_read(uring_t *u, int fd, void *buf, unsigned len, uint64_t off,
+		uint64_t data);
+
+// submit the queued reads and wait until at least wait of them completed
+int uring_submit(uring_t *u, unsigned wait);
+
+// take the next completion, returns 0 if there is none
+int uring_reap(uring_t *u, uint64_t *data, int *res);
+
+#endif
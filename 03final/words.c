@@ -0,0 +1,294 @@
+/* word frequency counting: tokenizer, per-worker word map and sorted runs */
+
+#include "words.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// size of the buffer the file is read into
+#define WORDS_READ_SIZE (1 << 20)
+
+#define WORD_MAP_INIT_SLOTS 4096
+
+// FNV-1a
+static uint64_t word_hash(const char *word, int len)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+	for (int i = 0; i < len; i++) {
+		h ^= (unsigned char)word[i];
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+void word_map_init(word_map_t *m)
+{
+	memset(m, 0, sizeof(word_map_t));
+}
+
+void word_map_free(word_map_t *m)
+{
+	free(m->slots);
+	free(m->arena);
+	word_map_init(m);
+}
+
+// forget every word but keep the memory for the next ones
+void word_map_clear(word_map_t *m)
+{
+	if (m->slots)
+		memset(m->slots, 0, m->nslots * sizeof(struct word_slot));
+	m->nused = 0;
+	m->arena_len = 0;
+}
+
+static int word_map_grow(word_map_t *m)
+{
+	uint32_t nslots = m->nslots ? m->nslots * 2 : WORD_MAP_INIT_SLOTS;
+	struct word_slot *slots = calloc(nslots, sizeof(struct word_slot));
+	if (!slots)
+		return -1;
+
+	for (uint32_t i = 0; i < m->nslots; i++) {
+		struct word_slot *s = &m->slots[i];
+		if (!s->len)
+			continue;
+		uint32_t j = s->hash & (nslots - 1);
+		while (slots[j].len)
+			j = (j + 1) & (nslots - 1);
+		slots[j] = *s;
+	}
+
+	free(m->slots);
+	m->slots = slots;
+	m->nslots = nslots;
+	return 0;
+}
+
+int word_map_add(word_map_t *m, const char *word, int len, uint64_t count)
+{
+	// keep the load factor below 1/2
+	if ((m->nused + 1) * 2 > m->nslots && word_map_grow(m) < 0)
+		return -1;
+
+	uint64_t hash = word_hash(word, len);
+	uint32_t i = hash & (m->nslots - 1);
+	for (;;) {
+		struct word_slot *s = &m->slots[i];
+		if (!s->len)
+			break;
+		if (s->hash == hash && s->len == len && memcmp(m->arena + s->key, word, len) == 0) {
+			s->count += count;
+			return 0;
+		}
+		i = (i + 1) & (m->nslots - 1);
+	}
+
+	if (m->arena_len + len > m->arena_cap) {
+		size_t cap = m->arena_cap ? m->arena_cap * 2 : (64 << 10);
+		char *arena = realloc(m->arena, cap);
+		if (!arena)
+			return -1;
+		m->arena = arena;
+		m->arena_cap = cap;
+	}
+	memcpy(m->arena + m->arena_len, word, len);
+
+	struct word_slot *s = &m->slots[i];
+	s->hash = hash;
+	s->count = count;
+	s->key = m->arena_len;
+	s->len = len;
+	m->arena_len += len;
+	m->nused += 1;
+	return 0;
+}
+
+void word_scan_init(word_scan_t *s, word_map_t *map, uint64_t start, uint64_t end)
+{
+	s->map = map;
+	s->start = start;
+	s->end = end;
+	s->pos = words_scan_start(start);
+	s->len = -1;
+	s->failed = 0;
+}
+
+static void word_scan_end_word(word_scan_t *s)
+{
+	int mine = s->word_start >= s->start && s->word_start < s->end;
+	if (mine && word_map_add(s->map, s->word, s->len, 1) < 0)
+		s->failed = 1;
+	s->len = -1;
+}
+
+void word_scan_feed(word_scan_t *s, const unsigned char *buf, size_t len)
+{
+	for (size_t i = 0; i < len; i++) {
+		unsigned l = (buf[i] | 0x20) - 'a';
+		if (l < 26) {
+			if (s->len < 0) {
+				s->len = 0;
+				s->word_start = s->pos + i;
+			}
+			if (s->len < WORD_MAX)
+				s->word[s->len++] = 'a' + l;
+		} else if (s->len >= 0) {
+			word_scan_end_word(s);
+		}
+	}
+	s->pos += len;
+}
+
+void word_scan_finish(word_scan_t *s)
+{
+	if (s->len >= 0)
+		word_scan_end_word(s);
+}
+
+int word_scan_file(word_map_t *map, const char *path, uint64_t start, uint64_t end,
+		int (*flush)(word_map_t *map, void *arg), void *arg)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	// the scan goes WORD_MAX bytes past end to finish its last word, but
+	// never past the end of file
+	uint64_t scan_end = end + WORD_MAX;
+	struct stat st;
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+		scan_end = words_scan_end(end, (uint64_t)st.st_size);
+
+	unsigned char *buf = malloc(WORDS_READ_SIZE);
+	int ret = buf ? 0 : -1;
+
+	word_scan_t scan;
+	word_scan_init(&scan, map, start, end);
+	while (ret == 0 && scan.pos < scan_end) {
+		size_t want = scan_end - scan.pos < WORDS_READ_SIZE ? scan_end - scan.pos
+			: WORDS_READ_SIZE;
+		ssize_t n = pread(fd, buf, want, scan.pos);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			ret = -1;
+		if (n <= 0)
+			break;
+
+		word_scan_feed(&scan, buf, n);
+		if (word_map_full(map) && flush(map, arg) < 0)
+			ret = -1;
+	}
+	if (ret == 0)
+		word_scan_finish(&scan);
+	if (ret == 0 && scan.failed) {
+		errno = ENOMEM;
+		ret = -1;
+	}
+
+	// keep the errno of a failed read for the caller
+	int err = errno;
+	free(buf);
+	close(fd);
+	errno = err;
+	return ret;
+}
+
+struct word_entry {
+	const char *word;
+	int len;
+	uint64_t count;
+};
+
+int word_cmp(const char *a, int alen, const char *b, int blen)
+{
+	int r = memcmp(a, b, alen < blen ? alen : blen);
+	return r ? r : alen - blen;
+}
+
+static int word_entry_cmp(const void *a, const void *b)
+{
+	const struct word_entry *x = a, *y = b;
+	return word_cmp(x->word, x->len, y->word, y->len);
+}
+
+int word_map_emit(word_map_t *m, int (*emit)(const char *buf, size_t len, void *arg),
+		void *arg)
+{
+	if (m->nused == 0)
+		return 0;
+
+	struct word_entry *entries = malloc(m->nused * sizeof(struct word_entry));
+	char *msg = malloc(WORDS_MSG_SIZE);
+	int ret = entries && msg ? 0 : -1;
+
+	uint32_t n = 0;
+	for (uint32_t i = 0; ret == 0 && i < m->nslots; i++) {
+		struct word_slot *s = &m->slots[i];
+		if (s->len)
+			entries[n++] = (struct word_entry){ m->arena + s->key, s->len, s->count };
+	}
+	if (ret == 0)
+		qsort(entries, n, sizeof(struct word_entry), word_entry_cmp);
+
+	size_t len = 0;
+	for (uint32_t i = 0; ret == 0 && i < n; i++) {
+		if (len + WORDS_ENTRY_MAX > WORDS_MSG_SIZE) {
+			ret = emit(msg, len, arg);
+			len = 0;
+		}
+
+		uint64_t count = htobe64(entries[i].count);
+		msg[len++] = entries[i].len;
+		memcpy(msg + len, entries[i].word, entries[i].len);
+		len += entries[i].len;
+		memcpy(msg + len, &count, sizeof(count));
+		len += sizeof(count);
+	}
+	if (ret == 0 && len > 0)
+		ret = emit(msg, len, arg);
+
+	free(entries);
+	free(msg);
+	return ret;
+}
+
+int word_run_next(const char *buf, size_t len, size_t *off, const char **word,
+		int *wlen, uint64_t *count)
+{
+	if (*off >= len)
+		return 0;
+
+	int n = (unsigned char)buf[*off];
+	if (n == 0 || n > WORD_MAX || len - *off < 1 + n + sizeof(uint64_t))
+		return -1;
+
+	*word = buf + *off + 1;
+	*wlen = n;
+	memcpy(count, buf + *off + 1 + n, sizeof(uint64_t));
+	*count = be64toh(*count);
+	*off += 1 + n + sizeof(uint64_t);
+	return 1;
+}
+
+int word_run_check(const char *buf, size_t len)
+{
+	const char *word, *prev = NULL;
+	int wlen, prev_len = 0, ret;
+	uint64_t count;
+	size_t off = 0;
+
+	while ((ret = word_run_next(buf, len, &off, &word, &wlen, &count)) > 0) {
+		if (prev && word_cmp(prev, prev_len, word, wlen) >= 0)
+			return -1;
+		prev = word;
+		prev_len = wlen;
+	}
+	return ret;
+}
@@ -0,0 +1,94 @@
+#ifndef __WORDS_H__
+#define __WORDS_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+// A word is a run of ascii letters, folded to lower case. Longer words are
+// truncated to their first WORD_MAX letters, so the word starting at the
+// last byte of a range is complete within WORD_MAX bytes after the range.
+#define WORD_MAX 64
+
+// A word belongs to the range its first letter is in. The byte before the
+// range tells whether the range starts in the middle of a word, so a range
+// [start, end) is scanned from words_scan_start(start) to
+// words_scan_end(end, file_len).
+#define words_scan_start(start) ((start) > 0 ? (start) - 1 : 0)
+#define words_scan_end(end, file_len) \
+	((end) + WORD_MAX < (file_len) ? (end) + WORD_MAX : (file_len))
+
+// the worker flushes its map as a run once the keys take this much memory
+#define WORDS_MAP_LIMIT (32 << 20)
+
+// a run is sent in messages of at most this size, each one a sorted run
+#define WORDS_MSG_SIZE (1 << 20)
+
+// a run entry is the word length (1 byte), the word and its count (u64,
+// network byte order); entries are sorted by word, bytewise
+#define WORDS_ENTRY_MAX (1 + WORD_MAX + 8)
+
+// open addressing hash map from words to counts, the words are kept in an
+// arena and entries refer to them by offset
+struct word_slot {
+	uint64_t hash;
+	uint64_t count;
+	uint32_t key;			// offset of the word in the arena
+	uint8_t len;			// 0 marks an empty slot
+};
+
+typedef struct {
+	struct word_slot *slots;
+	uint32_t nslots, nused;
+	char *arena;
+	size_t arena_len, arena_cap;
+} word_map_t;
+
+void word_map_init(word_map_t *m);
+void word_map_free(word_map_t *m);
+void word_map_clear(word_map_t *m);
+int word_map_add(word_map_t *m, const char *word, int len, uint64_t count);
+
+static inline int word_map_full(word_map_t *m)
+{
+	return m->arena_len >= WORDS_MAP_LIMIT;
+}
+
+// tokenizer state of a scan over [scan_start, scan_end) of a file, counting
+// the words that start in [start, end) into map
+typedef struct {
+	word_map_t *map;
+	uint64_t start, end;
+	uint64_t pos;			// file offset of the next byte fed
+	uint64_t word_start;
+	int len;				// letters of the current word, -1 when not in one
+	int failed;				// a word could not be added to the map
+	char word[WORD_MAX];
+} word_scan_t;
+
+void word_scan_init(word_scan_t *s, word_map_t *map, uint64_t start, uint64_t end);
+void word_scan_feed(word_scan_t *s, const unsigned char *buf, size_t len);
+void word_scan_finish(word_scan_t *s);
+
+// scan the words of file path in [start, end) into map, calling flush
+// whenever the map is full. Returns 0 on success and -1 with errno set if
+// the file could not be read.
+int word_scan_file(word_map_t *map, const char *path, uint64_t start, uint64_t end,
+		int (*flush)(word_map_t *map, void *arg), void *arg);
+
+// encode the map as a sorted run, calling emit for every message of at
+// most WORDS_MSG_SIZE bytes; stops and returns -1 if emit fails
+int word_map_emit(word_map_t *m, int (*emit)(const char *buf, size_t len, void *arg),
+		void *arg);
+
+// order of words in a run: bytewise, a prefix before the longer word
+int word_cmp(const char *a, int alen, const char *b, int blen);
+
+// decode the entry at buf[*off, len), returns 0 at the end of the run and
+// -1 if the entry is malformed
+int word_run_next(const char *buf, size_t len, size_t *off, const char **word,
+		int *wlen, uint64_t *count);
+
+// check that buf[0, len) is a well formed run
+int word_run_check(const char *buf, size_t len);
+
+#endif
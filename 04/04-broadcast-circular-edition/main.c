@@ -5,8 +5,79 @@
 
 #include <sys/types.h>
 #include <ifaddrs.h>
+#include <time.h>
 
 ustack_t *instance;
+
+// loop suppression: the fingerprints of the frames flooded lately are kept,
+// and a frame seen again within the window is dropped, it has gone round a
+// loop of hubs. Each slot of the table holds the upper bits of the hash of
+// a frame and the generation it was flooded in, a slot of an expired
+// generation is free again, so nothing ever sweeps the table.
+#define DEDUP_SLOTS 4096		// a power of 2
+#define DEDUP_PROBES 8
+#define DEDUP_GENS 4			// generations in a window
+#define DEDUP_GEN_MASK 0xffffULL
+
+static u64 dedup_table[DEDUP_SLOTS];
+static long dedup_window_ms;	// 0 if frames are never suppressed
+static u64 dedup_dropped;
+
+static u64 frame_hash(const char *packet, int len)
+{
+	u64 h = 0x9e3779b97f4a7c15ULL ^ len;
+	int i = 0;
+	for (; i + 8 <= len; i += 8) {
+		u64 w;
+		memcpy(&w, packet + i, 8);
+		h = (h ^ w) * 0xff51afd7ed558ccdULL;
+		h ^= h >> 32;
+	}
+	u64 w = 0;
+	memcpy(&w, packet + i, len - i);
+	h = (h ^ w) * 0xc4ceb9fe1a85ec53ULL;
+	return h ^ (h >> 29);
+}
+
+static u64 dedup_generation()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	long gen_ms = dedup_window_ms / DEDUP_GENS > 0 ? dedup_window_ms / DEDUP_GENS : 1;
+	return (ts.tv_sec * 1000 + ts.tv_nsec / 1000000) / gen_ms;
+}
+
+// whether the frame was flooded within the window, the frame is recorded
+// as flooded now if not. Slots are claimed with compare and swap, so
+// receiving threads may share the table.
+static int frame_seen(const char *packet, int len)
+{
+	u64 h = frame_hash(packet, len);
+	u64 gen = dedup_generation() & DEDUP_GEN_MASK;
+	// never 0, which is an empty slot
+	u64 key = (h & ~DEDUP_GEN_MASK) | (DEDUP_GEN_MASK + 1);
+	u64 entry = key | gen;
+
+	for (int i = 0; i < DEDUP_PROBES; i++) {
+		u64 *slot = &dedup_table[(h + i) & (DEDUP_SLOTS - 1)];
+		u64 old = __atomic_load_n(slot, __ATOMIC_RELAXED);
+		for (;;) {
+			int live = old != 0 && ((gen - old) & DEDUP_GEN_MASK) < DEDUP_GENS;
+			if (live && (old & ~DEDUP_GEN_MASK) == key)
+				return 1;
+			if (live)
+				break;
+			if (__atomic_compare_exchange_n(slot, &old, entry, 0,
+						__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				return 0;
+			// another thread claimed the slot first, look at what it put
+		}
+	}
+
+	// every slot probed is live, the first one is taken over
+	__atomic_store_n(&dedup_table[h & (DEDUP_SLOTS - 1)], entry, __ATOMIC_RELAXED);
+	return 0;
+}
 //from iface_list find corresponding iface
 static iface_info_t *fd_to_iface(int fd)
 {
@@ -53,6 +124,13 @@ void broadcast_packet(iface_info_t *iface, const char *packet, int len)
 
 void handle_packet(iface_info_t *iface, char *packet, int len)
 {
+	if (dedup_window_ms > 0 && frame_seen(packet, len)) {
+		u64 n = __atomic_add_fetch(&dedup_dropped, 1, __ATOMIC_RELAXED);
+		if ((n & (n - 1)) == 0)
+			log(INFO, "%lu looping frames dropped so far", (unsigned long)n);
+		return;
+	}
+
 	broadcast_packet(iface, packet, len);
 }
 
@@ -256,6 +334,17 @@ int main(int argc, const char **argv)
 		exit(1);
 	}
 
+	// -l: drop the frames flooded already within the last ms milliseconds
+	int opt;
+	while ((opt = getopt(argc, (char **)argv, "l:")) != -1) {
+		if (opt == 'l' && atol(optarg) > 0)
+			dedup_window_ms = atol(optarg);
+		else {
+			fprintf(stderr, "Usage: %s [-l ms]\n", argv[0]);
+			exit(1);
+		}
+	}
+
 	init_ustack();
 
 	ustack_run();
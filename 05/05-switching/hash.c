@@ -24,3 +24,15 @@ u16 hash16(unsigned char *addr, int len)
 	
 	return result;
 }
+
+// every bit of key affects every bit of the result (the finalizer of
+// MurmurHash3)
+u64 hash64(u64 key)
+{
+	key ^= key >> 33;
+	key *= 0xff51afd7ed558ccdULL;
+	key ^= key >> 33;
+	key *= 0xc4ceb9fe1a85ec53ULL;
+	key ^= key >> 33;
+	return key;
+}
@@ -36,6 +36,16 @@ typedef struct {
 	char name[16];
 	char ip_str[16];
 
+	// PACKET_MMAP rings, NULL if the socket copies frames, see ring.c
+	struct packet_ring *ring;
+
+	// the number of the port in the forwarding database, see mac.c
+	int port;
+
+	// the policers of the frames flooded from the port, NULL if they are
+	// not limited, see storm.c
+	struct storm_control *storm;
+
 #ifdef DYNAMIC_ROUTING
 	// list of ospf neighbors
 	int helloint;
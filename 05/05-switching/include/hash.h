@@ -11,5 +11,7 @@ u8 hash8(unsigned char *addr, int len);
 
 u16 hash16(unsigned char *addr, int len);
 
+u64 hash64(u64 key);
+
 
 #endif
@@ -5,30 +5,94 @@
 #include "hash.h"
 #include "headers.h"
 
+// a station not seen for MAC_PORT_TIMEOUT seconds is aged out. Nothing
+// sweeps the table for it: a lookup takes an aged station for an unknown
+// one, and learning reuses its slot, so that aging costs O(1) per station
+// and only in the buckets frames touch anyway.
 #define MAC_PORT_TIMEOUT 30
 
-struct mac_port_entry {
-	uint8_t mac[ETH_ALEN];
-	iface_info_t *iface;
-	time_t visited;
-	struct mac_port_entry *next;
-};
+// the forwarding database: a station is looked for in two buckets chosen by
+// a seeded hash of its full 48-bit address, and learned into the emptier of
+// the two, so that a lookup reads at most 2 * MAC_BUCKET_SLOTS slots. With
+// two choices the buckets fill evenly, 64k stations take half the table.
+#define MAC_BUCKET_SLOTS 8
+#define MAC_BUCKETS (1 << 14)		// a power of 2
+
+// ports are numbered from 1, a slot of port 0 is free
+#define MAC_MAX_PORTS 256
 
-typedef struct mac_port_entry mac_port_entry_t;
+// a slot holds the address of a station in its upper 48 bits and the port
+// it was learned on in its lower 16 bits, so that a station and its port
+// are always read together, by a single atomic load
+#define MAC_SLOT_PORT_MASK 0xffffULL
+#define mac_slot_addr(slot) ((slot) >> 16)
+#define mac_slot_port(slot) ((int)((slot) & MAC_SLOT_PORT_MASK))
 
+struct mac_bucket {
+	u64 slots[MAC_BUCKET_SLOTS];		// a cache line, what a lookup scans
+	time_t visited[MAC_BUCKET_SLOTS];	// when the station was last seen
+	u32 moves[MAC_BUCKET_SLOTS];		// how often it moved to another port
+};
+
+// forwarding threads look ports up without any lock: a slot is published
+// by an atomic store of the whole word, and a reader sees either the old
+// station or the new one. The buckets are never moved or freed while the
+// switch runs, so there is nothing to reclaim. Only the writers, learning
+// a new station or port and aging, are serialized by the lock.
 typedef struct {
-	mac_port_entry_t *hash_table[HASH_8BITS];
+	struct mac_bucket *buckets;
+	u64 seed;							// of the hash, so that the buckets
+										// of a station cannot be predicted
+	iface_info_t *ports[MAC_MAX_PORTS];
+	int nports;
+	u64 learned;						// stations learned, a moved one
+										// is not learned again
+	u64 aged;							// stations whose slot was reused
+										// after they aged out
+	u64 evicted;						// live stations dropped for room
+	u64 moved;							// stations learned on another port
 	pthread_mutex_t lock;
-	pthread_mutexattr_t attr;
-	pthread_t tid;
 } mac_port_map_t;
 
-void *sweeping_mac_port_thread(void *);
+// the table is saved to a snapshot file, checked every
+// MAC_SNAPSHOT_INTERVAL seconds by default and written if it changed, so
+// that a restarted switch learns back the stations not aged out meanwhile
+// instead of flooding their frames. The file is a header, the
+// names of the ports, port i + 1 at i, and the stations, each with the
+// number of the port it was learned on. Ports are matched by name when
+// loading, the stations of a port which is gone are dropped.
+#define MAC_SNAPSHOT_INTERVAL 1
+#define MAC_SNAPSHOT_MAGIC "FDBSNAP"
+#define MAC_SNAPSHOT_VERSION 1
+
+struct mac_snapshot_header {
+	char magic[8];
+	u32 version;
+	u32 nports;
+	u32 nstations;
+	u32 timeout;						// MAC_PORT_TIMEOUT when saved
+	u64 saved;							// time of the snapshot
+};
+
+struct mac_snapshot_entry {
+	u64 slot;
+	u64 visited;
+};
+
 void init_mac_hash_table();
 void destory_mac_hash_table();
 void dump_mac_port_table();
 iface_info_t *lookup_port(uint8_t mac[ETH_ALEN]);
 void insert_mac_port(uint8_t mac[ETH_ALEN], iface_info_t *iface);
-int sweep_aged_mac_port_entry();
+
+// save the table to path, written anew and renamed into place so that a
+// snapshot is never seen half written
+int mac_snapshot_save(const char *path);
+// learn the fresh stations of the snapshot at path, returns how many, or -1
+// if there is none or it is not valid
+int mac_snapshot_load(const char *path);
+// save the table to path every interval seconds from now on, when
+// stations were learned, moved or dropped for room since the last save
+void mac_snapshot_start(const char *path, int interval);
 
 #endif
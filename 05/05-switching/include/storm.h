@@ -0,0 +1,55 @@
+#ifndef __STORM_H__
+#define __STORM_H__
+
+#include "base.h"
+
+#include <stdio.h>
+
+// storm control: a broadcast, multicast or unknown unicast frame a port
+// receives is flooded to every other port, so each port polices these
+// frames with a token bucket per class, limited in frames and in bits per
+// second. A frame over either limit is dropped, and counted.
+enum storm_class {
+	STORM_BROADCAST,
+	STORM_MULTICAST,
+	STORM_UNKNOWN,
+	STORM_CLASSES,
+};
+
+// a bucket holds what its rates allow in this many ms, so that bursts pass
+#define STORM_BURST_MS 100
+
+// the ports which dropped frames are logged this often, in s
+#define STORM_REPORT_INTERVAL 10
+
+// tokens are kept in 1e-9 frames and bytes, a bucket gains its rate per ns.
+// Only the thread receiving on the port polices it, the counters are read
+// by the reporting thread and the dump of the mac_port table.
+struct storm_policer {
+	u64 pps, bps;						// 0 if unlimited
+	u64 frame_tokens, byte_tokens;
+	u64 frame_burst, byte_burst;		// what the buckets hold at most
+	u64 last;							// when they were filled, in ns
+	u64 passed, dropped;
+	u64 reported;						// dropped when last logged
+};
+
+struct storm_control {
+	struct storm_policer policers[STORM_CLASSES];
+};
+
+// set the limits of a class from "class=pps[,bps]", class being broadcast,
+// multicast, unknown or all. Returns -1 if arg is not valid.
+int storm_parse(const char *arg);
+
+// police the ports if any limit is set, and log their drops
+void init_storm_control();
+
+// whether the frame to dhost of len bytes, received on iface and flooded
+// as no port is known for it, is within the limits of iface
+int storm_admit(iface_info_t *iface, const u8 dhost[ETH_ALEN], int len);
+
+// print the frames of each class every policed port passed and dropped
+void storm_dump(FILE *fp);
+
+#endif
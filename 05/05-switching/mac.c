@@ -1,145 +1,465 @@
 #include "mac.h"
 #include "headers.h"
 #include "log.h"
+#include "storm.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/stat.h>
 
 mac_port_map_t mac_port_map;
 
-void init_mac_hash_table()
+static u64 mac_to_addr(const u8 mac[ETH_ALEN])
 {
-	bzero(&mac_port_map, sizeof(mac_port_map_t));
+	u64 addr = 0;
+	for (int i = 0; i < ETH_ALEN; i++)
+		addr = (addr << 8) | mac[i];
+	return addr;
+}
 
-	pthread_mutexattr_init(&mac_port_map.attr);
-	pthread_mutexattr_settype(&mac_port_map.attr, PTHREAD_MUTEX_RECURSIVE);
-	pthread_mutex_init(&mac_port_map.lock, &mac_port_map.attr);
+static void addr_to_mac(u64 addr, u8 mac[ETH_ALEN])
+{
+	for (int i = ETH_ALEN - 1; i >= 0; i--) {
+		mac[i] = addr & 0xff;
+		addr >>= 8;
+	}
+}
 
-	pthread_create(&mac_port_map.tid, NULL, sweeping_mac_port_thread, NULL);
+// the two buckets a station may be in
+static void mac_buckets(u64 addr, struct mac_bucket **b1, struct mac_bucket **b2)
+{
+	u64 h = hash64(addr ^ mac_port_map.seed);
+	u32 i1 = h & (MAC_BUCKETS - 1);
+	u32 i2 = (h >> 32) & (MAC_BUCKETS - 1);
+	if (i2 == i1)
+		i2 = i1 ^ 1;
+	*b1 = &mac_port_map.buckets[i1];
+	*b2 = &mac_port_map.buckets[i2];
 }
 
-void destory_mac_hash_table()
+// the slot of the station in b and what it holds, -1 if it is not there
+static int bucket_find(struct mac_bucket *b, u64 addr, u64 *slot)
 {
-	pthread_mutex_lock(&mac_port_map.lock);
-	mac_port_entry_t *tmp, *entry;
-	for (int i = 0; i < HASH_8BITS; i++) {
-		entry = mac_port_map.hash_table[i];
-		if (!entry) 
-			continue;
+	for (int i = 0; i < MAC_BUCKET_SLOTS; i++) {
+		*slot = __atomic_load_n(&b->slots[i], __ATOMIC_ACQUIRE);
+		if (*slot != 0 && mac_slot_addr(*slot) == addr)
+			return i;
+	}
+	return -1;
+}
 
-		tmp = entry->next;
-		while (tmp) {
-			entry->next = tmp->next;
-			free(tmp);
-			tmp = entry->next;
+// the station in either of its buckets, -1 if it is in none
+static int mac_find(u64 addr, struct mac_bucket *b1, struct mac_bucket *b2,
+		struct mac_bucket **b, u64 *slot)
+{
+	*b = b1;
+	int i = bucket_find(b1, addr, slot);
+	if (i < 0) {
+		*b = b2;
+		i = bucket_find(b2, addr, slot);
+	}
+	return i;
+}
+
+static int mac_aged(struct mac_bucket *b, int i, time_t now)
+{
+	return now - __atomic_load_n(&b->visited[i], __ATOMIC_ACQUIRE) > MAC_PORT_TIMEOUT;
+}
+
+// whether the station a reader loaded from slot i of b is still there and
+// not aged out. A slot is emptied before it is reused and its new age
+// stored after that, so if the age read is a new station's, the slot reads
+// as changed.
+static int mac_live(struct mac_bucket *b, int i, u64 slot, time_t now)
+{
+	return !mac_aged(b, i, now) && __atomic_load_n(&b->slots[i], __ATOMIC_RELAXED) == slot;
+}
+
+// the number of free slots in b, aged stations' included, and the first of
+// them
+static int bucket_free(struct mac_bucket *b, int *first, time_t now)
+{
+	int n = 0;
+	*first = -1;
+	for (int i = MAC_BUCKET_SLOTS - 1; i >= 0; i--) {
+		if (b->slots[i] == 0 || mac_aged(b, i, now)) {
+			*first = i;
+			n += 1;
 		}
-		free(entry);
 	}
-	pthread_mutex_unlock(&mac_port_map.lock);
+	return n;
+}
+
+void init_mac_hash_table()
+{
+	bzero(&mac_port_map, sizeof(mac_port_map_t));
+
+	mac_port_map.buckets = calloc(MAC_BUCKETS, sizeof(struct mac_bucket));
+	if (!mac_port_map.buckets) {
+		log(ERROR, "could not allocate the mac_port table.");
+		exit(1);
+	}
+	if (getrandom(&mac_port_map.seed, sizeof(mac_port_map.seed), 0) != sizeof(mac_port_map.seed))
+		mac_port_map.seed = ((u64)time(NULL) << 32) ^ getpid();
+
+	iface_info_t *iface = NULL;
+	list_for_each_entry(iface, &instance->iface_list, list) {
+		if (mac_port_map.nports + 1 >= MAC_MAX_PORTS) {
+			log(ERROR, "too many ports, at most %d are supported.", MAC_MAX_PORTS - 1);
+			exit(1);
+		}
+		iface->port = ++mac_port_map.nports;
+		mac_port_map.ports[iface->port] = iface;
+	}
+
+	pthread_mutex_init(&mac_port_map.lock, NULL);
+}
+
+// readers do not take the lock, so the table may only be destroyed once
+// no thread forwards any more
+void destory_mac_hash_table()
+{
+	free(mac_port_map.buckets);
+	mac_port_map.buckets = NULL;
+	pthread_mutex_destroy(&mac_port_map.lock);
 }
 
 //search for corresponding iface. if not exist, return NULL
 iface_info_t *lookup_port(u8 mac[ETH_ALEN])
 {
-	pthread_mutex_lock(&mac_port_map.lock);
+	u64 addr = mac_to_addr(mac);
+	struct mac_bucket *b1, *b2, *b;
+	u64 slot;
+	mac_buckets(addr, &b1, &b2);
+
 	iface_info_t * iface = NULL;
-	
-	//if corresponding iface exist
-	if(mac_port_map.hash_table[mac[0]])
-	{
-		for(i = 0; i < ETH_ALEN; i++ )
-			if(mac_port_map.hash_table[mac[0]]->mac[i] != mac[i])
-				return NULL;
-		iface = mac_port_map.hash_table[mac[0]]->iface;
-		mac_port_map.hash_table[mac[0]]->visited = time(NULL);
+	time_t now = time(NULL);
+	int i = mac_find(addr, b1, b2, &b, &slot);
+	if (i >= 0 && mac_live(b, i, slot, now)) {
+		iface = mac_port_map.ports[mac_slot_port(slot)];
+		// readers may refresh it at the same time
+		__atomic_store_n(&b->visited[i], now, __ATOMIC_RELAXED);
 	}
-	pthread_mutex_unlock(&mac_port_map.lock);
 	return iface;
 }
 
-//insert new transform table entry
-void insert_mac_port(u8 mac[ETH_ALEN], iface_info_t *iface)
+// learn that the station was seen on port at visited
+static void mac_learn(u64 addr, int port, time_t visited)
 {
-	static int i;
-	
-	//malloc new entry
-	mac_port_entry_t * entry = (mac_port_entry_t *)malloc(sizeof(mac_port_entry_t));
+	u64 slot = (addr << 16) | port, found;
+	struct mac_bucket *b1, *b2, *b;
+	mac_buckets(addr, &b1, &b2);
+	time_t now = time(NULL);
+
 	pthread_mutex_lock(&mac_port_map.lock);
-	
-	//free existed entry
-	if(mac_port_map.hash_table[mac[0]])
-		free(mac_port_map.hash_table[mac[0]]);
-	
-	//assign hast_table entry and its predecessor
-	mac_port_map.hash_table[mac[0]] = entry;
-	if(mac_port_map.hash_table[(i-1)%HASH_8BITS])
-		mac_port_map.hash_table[(i-1)%HASH_8BITS]->next = entry;
-	
-	//assign entry details
-	for(i = 0; i < ETH_ALEN; i++ )
-		mac_port_map.hash_table[mac[0]]->mac[i] = mac[i];
-	mac_port_map.hash_table[mac[0]]->iface = (iface_info_t *)malloc(sizeof(iface_info_t));
-	memcpy(mac_port_map.hash_table[mac[0]]->iface, iface, sizeof(iface_info_t));
-	mac_port_map.hash_table[mac[0]]->next = mac_port_map.hash_table[(mac[0] + 1) % HASH_8BITS];
-	mac_port_map.hash_table[mac[0]]->visited = time(NULL);
+	// another thread may have learned it meanwhile
+	int i = mac_find(addr, b1, b2, &b, &found);
+	if (i >= 0 && !mac_aged(b, i, now)) {
+		__atomic_store_n(&b->visited[i], visited, __ATOMIC_RELAXED);
+		if (found != slot) {
+			__atomic_store_n(&b->slots[i], slot, __ATOMIC_RELEASE);
+			b->moves[i] += 1;
+			mac_port_map.moved += 1;
+		}
+		pthread_mutex_unlock(&mac_port_map.lock);
+		return;
+	}
+
+	// into the slot of the station if it aged out, else into the emptier
+	// bucket, and if both are full the station seen least recently makes room
+	if (i < 0) {
+		int first1, first2;
+		int free1 = bucket_free(b1, &first1, now), free2 = bucket_free(b2, &first2, now);
+		b = free2 > free1 ? b2 : b1;
+		i = free2 > free1 ? first2 : first1;
+	}
+	if (i < 0) {
+		b = b1;
+		i = 0;
+		for (int j = 0; j < 2 * MAC_BUCKET_SLOTS; j++) {
+			struct mac_bucket *c = j < MAC_BUCKET_SLOTS ? b1 : b2;
+			int k = j % MAC_BUCKET_SLOTS;
+			if (__atomic_load_n(&c->visited[k], __ATOMIC_RELAXED) <
+					__atomic_load_n(&b->visited[i], __ATOMIC_RELAXED)) {
+				b = c;
+				i = k;
+			}
+		}
+		mac_port_map.evicted += 1;
+	}
+	else if (b->slots[i] != 0) {
+		mac_port_map.aged += 1;
+	}
+
+	// a reader may have loaded the station in the slot before, it must not
+	// take the new age for that station's: the slot is emptied first, and
+	// the new station published last, with its age already set
+	if (b->slots[i] != 0)
+		__atomic_store_n(&b->slots[i], 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&b->visited[i], visited, __ATOMIC_RELEASE);
+	b->moves[i] = 0;
+	__atomic_store_n(&b->slots[i], slot, __ATOMIC_RELEASE);
+	mac_port_map.learned += 1;
 	pthread_mutex_unlock(&mac_port_map.lock);
+}
 
+//learn the port of a station, or that it moved to another port
+void insert_mac_port(u8 mac[ETH_ALEN], iface_info_t *iface)
+{
+	// a group address is never the source of a frame
+	if ((mac[0] & 1) || iface->port == 0)
+		return;
+
+	u64 addr = mac_to_addr(mac);
+	u64 slot = (addr << 16) | iface->port, found;
+	struct mac_bucket *b1, *b2, *b;
+	mac_buckets(addr, &b1, &b2);
+	time_t now = time(NULL);
+
+	// most frames come from a station learned on the same port already, it
+	// is only refreshed then
+	int i = mac_find(addr, b1, b2, &b, &found);
+	if (i >= 0 && found == slot && mac_live(b, i, slot, now)) {
+		__atomic_store_n(&b->visited[i], now, __ATOMIC_RELAXED);
+		return;
+	}
+
+	mac_learn(addr, iface->port, now);
 }
 
 void dump_mac_port_table()
 {
-	mac_port_entry_t *entry = NULL;
 	time_t now = time(NULL);
+	int n = 0;
 
 	fprintf(stdout, "dumping the mac_port table:\n");
 	pthread_mutex_lock(&mac_port_map.lock);
-	for (int i = 0; i < HASH_8BITS; i++) {
-		entry = mac_port_map.hash_table[i];
-		while (entry) {
-			fprintf(stdout, ETHER_STRING " -> %s, %d\n", ETHER_FMT(entry->mac), \
-					entry->iface->name, (int)(now - entry->visited));
+	for (int i = 0; i < MAC_BUCKETS; i++) {
+		struct mac_bucket *b = &mac_port_map.buckets[i];
+		for (int j = 0; j < MAC_BUCKET_SLOTS; j++) {
+			if (b->slots[j] == 0 || mac_aged(b, j, now))
+				continue;
 
-			entry = entry->next;
+			u8 mac[ETH_ALEN];
+			addr_to_mac(mac_slot_addr(b->slots[j]), mac);
+			fprintf(stdout, ETHER_STRING " -> %s, %d, moved %u times\n", ETHER_FMT(mac), \
+					mac_port_map.ports[mac_slot_port(b->slots[j])]->name, \
+					(int)(now - b->visited[j]), b->moves[j]);
+			n += 1;
 		}
 	}
+	fprintf(stdout, "%d stations, %lu learned, %lu aged out, %lu evicted for room.\n", n, \
+			(unsigned long)mac_port_map.learned, (unsigned long)mac_port_map.aged, \
+			(unsigned long)mac_port_map.evicted);
 
 	pthread_mutex_unlock(&mac_port_map.lock);
+	storm_dump(stdout);
 }
 
-//remove aged entry 
-int sweep_aged_mac_port_entry()
+int mac_snapshot_save(const char *path)
 {
-	static int i;
 	time_t now = time(NULL);
-	pthread_mutex_lock(&mac_port_map.lock);
-	
-	//traversal the table
-	for(i = 0; i < HASH_8BITS; i++ )
-	{
-		
-		//if not exist
-		if(!mac_port_map.hash_table[i])
-			continue;
-		
-		//if aged
-		if((now - mac_port_map.hash_table[i]->visited) > 30)
-		{
-			free(mac_port_map.hash_table[i]);
-			mac_port_map.hash_table[i] = NULL;
-			if(mac_port_map.hash_table[(i-1)%HASH_8BITS])
-				mac_port_map.hash_table[(i-1)%HASH_8BITS]->next = NULL;
+	char tmp[strlen(path) + 8];
+	sprintf(tmp, "%s.tmp", path);
+
+	// stations may come and go while saving, the first pass only bounds
+	// how many the second one writes
+	u32 n = 0;
+	for (int i = 0; i < MAC_BUCKETS; i++) {
+		struct mac_bucket *b = &mac_port_map.buckets[i];
+		for (int j = 0; j < MAC_BUCKET_SLOTS; j++)
+			if (__atomic_load_n(&b->slots[j], __ATOMIC_RELAXED) != 0 && !mac_aged(b, j, now))
+				n += 1;
+	}
+
+	size_t names_len = mac_port_map.nports * IFNAMSIZ;
+	size_t len = sizeof(struct mac_snapshot_header) + names_len + \
+				 n * sizeof(struct mac_snapshot_entry);
+
+	int fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		log(ERROR, "creating the snapshot %s failed: %s", tmp, strerror(errno));
+		return -1;
+	}
+	if (ftruncate(fd, len) < 0) {
+		log(ERROR, "sizing the snapshot %s failed: %s", tmp, strerror(errno));
+		close(fd);
+		unlink(tmp);
+		return -1;
+	}
+	char *map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		log(ERROR, "mapping the snapshot %s failed: %s", tmp, strerror(errno));
+		close(fd);
+		unlink(tmp);
+		return -1;
+	}
+
+	struct mac_snapshot_header *hdr = (struct mac_snapshot_header *)map;
+	char *names = map + sizeof(*hdr);
+	struct mac_snapshot_entry *entries = (struct mac_snapshot_entry *)(names + names_len);
+
+	for (int port = 1; port <= mac_port_map.nports; port++)
+		strncpy(names + (port - 1) * IFNAMSIZ, mac_port_map.ports[port]->name, IFNAMSIZ);
+
+	u32 k = 0;
+	for (int i = 0; i < MAC_BUCKETS && k < n; i++) {
+		struct mac_bucket *b = &mac_port_map.buckets[i];
+		for (int j = 0; j < MAC_BUCKET_SLOTS && k < n; j++) {
+			u64 slot = __atomic_load_n(&b->slots[j], __ATOMIC_ACQUIRE);
+			if (slot == 0 || mac_aged(b, j, now))
+				continue;
+			entries[k].slot = slot;
+			entries[k].visited = __atomic_load_n(&b->visited[j], __ATOMIC_RELAXED);
+			k += 1;
 		}
 	}
-	pthread_mutex_unlock(&mac_port_map.lock);
+
+	memcpy(hdr->magic, MAC_SNAPSHOT_MAGIC, sizeof(hdr->magic));
+	hdr->version = MAC_SNAPSHOT_VERSION;
+	hdr->nports = mac_port_map.nports;
+	hdr->nstations = k;
+	hdr->timeout = MAC_PORT_TIMEOUT;
+	hdr->saved = now;
+	munmap(map, len);
+
+	// the stations gone between the passes leave zeroed entries behind,
+	// which are cut off
+	int ret = k < n ? ftruncate(fd, len - (n - k) * sizeof(struct mac_snapshot_entry)) : 0;
+	if (ret < 0) {
+		log(ERROR, "sizing the snapshot %s failed: %s", tmp, strerror(errno));
+		close(fd);
+		unlink(tmp);
+		return -1;
+	}
+	// on disk before it replaces the last one, or a crash could leave an
+	// empty snapshot in its place
+	ret = fsync(fd);
+	close(fd);
+	if (ret < 0) {
+		log(ERROR, "syncing the snapshot %s failed: %s", tmp, strerror(errno));
+		unlink(tmp);
+		return -1;
+	}
+	if (rename(tmp, path) < 0) {
+		log(ERROR, "renaming the snapshot %s failed: %s", tmp, strerror(errno));
+		unlink(tmp);
+		return -1;
+	}
+
 	return 0;
 }
 
-void *sweeping_mac_port_thread(void *nil)
+int mac_snapshot_load(const char *path)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		if (errno != ENOENT)
+			log(ERROR, "opening the snapshot %s failed: %s", path, strerror(errno));
+		return -1;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) < 0 || st.st_size < sizeof(struct mac_snapshot_header)) {
+		log(ERROR, "the snapshot %s is truncated.", path);
+		close(fd);
+		return -1;
+	}
+	char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		log(ERROR, "mapping the snapshot %s failed: %s", path, strerror(errno));
+		return -1;
+	}
+
+	struct mac_snapshot_header *hdr = (struct mac_snapshot_header *)map;
+	if (memcmp(hdr->magic, MAC_SNAPSHOT_MAGIC, sizeof(hdr->magic)) != 0 || \
+			hdr->version != MAC_SNAPSHOT_VERSION) {
+		log(ERROR, "%s is not a snapshot of version %d.", path, MAC_SNAPSHOT_VERSION);
+		munmap(map, st.st_size);
+		return -1;
+	}
+	size_t names_len = (size_t)hdr->nports * IFNAMSIZ;
+	if (hdr->nports >= MAC_MAX_PORTS || st.st_size != sizeof(*hdr) + names_len + \
+			(size_t)hdr->nstations * sizeof(struct mac_snapshot_entry)) {
+		log(ERROR, "the snapshot %s is corrupt.", path);
+		munmap(map, st.st_size);
+		return -1;
+	}
+
+	// the number of each saved port now, 0 if there is no such port any more
+	int ports[MAC_MAX_PORTS] = { 0 };
+	char *names = map + sizeof(*hdr);
+	for (int port = 1; port <= hdr->nports; port++) {
+		const char *name = names + (port - 1) * IFNAMSIZ;
+		for (int p = 1; p <= mac_port_map.nports; p++)
+			if (strncmp(name, mac_port_map.ports[p]->name, IFNAMSIZ) == 0)
+				ports[port] = p;
+	}
+
+	time_t now = time(NULL);
+	int n = 0;
+	struct mac_snapshot_entry *entries = (struct mac_snapshot_entry *)(names + names_len);
+	for (u32 i = 0; i < hdr->nstations; i++) {
+		int port = mac_slot_port(entries[i].slot);
+		time_t visited = entries[i].visited;
+		if (port > hdr->nports || ports[port] == 0 || visited > now || \
+				now - visited > MAC_PORT_TIMEOUT)
+			continue;
+
+		mac_learn(mac_slot_addr(entries[i].slot), ports[port], visited);
+		n += 1;
+	}
+
+	munmap(map, st.st_size);
+	return n;
+}
+
+static const char *snapshot_path;
+static int snapshot_interval;
+
+// the stations learned, moved or dropped for room so far, the table only
+// changes otherwise by their ages
+static u64 mac_changes()
+{
+	pthread_mutex_lock(&mac_port_map.lock);
+	u64 changes = mac_port_map.learned + mac_port_map.moved + mac_port_map.evicted;
+	pthread_mutex_unlock(&mac_port_map.lock);
+	return changes;
+}
+
+static void *snapshot_thread(void *nil)
 {
+	u64 saved_changes = mac_changes();
+	time_t saved = time(NULL);
 	while (1) {
-		sleep(1);
-		int n = sweep_aged_mac_port_entry();
+		sleep(snapshot_interval);
 
-		if (n > 0)
-			log(DEBUG, "%d aged entries in mac_port table are removed.\n", n);
+		// an unchanged table is saved again only so that the ages in the
+		// snapshot do not fall too far behind those of stations still seen
+		u64 changes = mac_changes();
+		time_t now = time(NULL);
+		if (changes == saved_changes && now - saved < MAC_PORT_TIMEOUT / 2)
+			continue;
+		if (mac_snapshot_save(snapshot_path) == 0) {
+			saved_changes = changes;
+			saved = now;
+		}
 	}
 
 	return NULL;
 }
+
+void mac_snapshot_start(const char *path, int interval)
+{
+	snapshot_path = path;
+	snapshot_interval = interval;
+
+	pthread_t tid;
+	if (pthread_create(&tid, NULL, snapshot_thread, NULL) != 0) {
+		log(ERROR, "could not start saving the mac_port table.");
+		return;
+	}
+	pthread_detach(tid);
+}
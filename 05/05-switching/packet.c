@@ -1,4 +1,7 @@
+#define _GNU_SOURCE		// sendmmsg
+
 #include "packet.h"
+#include "ring.h"
 #include "types.h"
 #include "ether.h"
 
@@ -7,20 +10,57 @@
 #include <assert.h>
 #include <string.h>
 #include <arpa/inet.h>
+#include <sys/socket.h>
 #include <linux/if_packet.h>
- 
+
 extern ustack_t *instance;
 
-void iface_send_packet(iface_info_t *iface, const char *packet, int len)
+// frames queued on a socket, copied since the caller reuses its buffer
+struct packet_batch {
+	int n;
+	struct mmsghdr msgs[PACKET_BATCH];
+	struct iovec iovs[PACKET_BATCH];
+	struct sockaddr_ll addrs[PACKET_BATCH];
+	char frames[PACKET_BATCH][ETH_FRAME_LEN];
+};
+
+// the frames sent on this thread while batching, a queue per socket
+static __thread int batching;
+static __thread struct packet_batch **batches;
+static __thread int nbatches;
+
+// the queue of the socket of iface, NULL if it could not be allocated
+static struct packet_batch *iface_batch(iface_info_t *iface)
 {
-	struct sockaddr_ll addr;
-	memset(&addr, 0, sizeof(struct sockaddr_ll));
-	addr.sll_family = AF_PACKET;
-	addr.sll_ifindex = iface->index;
-	addr.sll_halen = ETH_ALEN;
-	addr.sll_protocol = htons(ETH_P_ARP);
+	if (iface->fd >= nbatches) {
+		int n = iface->fd + 1;
+		struct packet_batch **grown = realloc(batches, n * sizeof(*batches));
+		if (!grown)
+			return NULL;
+		memset(grown + nbatches, 0, (n - nbatches) * sizeof(*batches));
+		batches = grown;
+		nbatches = n;
+	}
+	if (!batches[iface->fd])
+		batches[iface->fd] = calloc(1, sizeof(struct packet_batch));
+	return batches[iface->fd];
+}
+
+static void fill_addr(struct sockaddr_ll *addr, iface_info_t *iface, const char *packet)
+{
+	memset(addr, 0, sizeof(struct sockaddr_ll));
+	addr->sll_family = AF_PACKET;
+	addr->sll_ifindex = iface->index;
+	addr->sll_halen = ETH_ALEN;
+	addr->sll_protocol = htons(ETH_P_ARP);
 	struct ether_header *eh = (struct ether_header *)packet;
-	memcpy(addr.sll_addr, eh->ether_dhost, ETH_ALEN);
+	memcpy(addr->sll_addr, eh->ether_dhost, ETH_ALEN);
+}
+
+static void iface_send_now(iface_info_t *iface, const char *packet, int len)
+{
+	struct sockaddr_ll addr;
+	fill_addr(&addr, iface, packet);
 
 	if (sendto(iface->fd, packet, len, 0, (const struct sockaddr *)&addr,
 				sizeof(struct sockaddr_ll)) < 0) {
@@ -28,6 +68,71 @@ void iface_send_packet(iface_info_t *iface, const char *packet, int len)
 	}
 }
 
+// send the frames queued on socket fd, a frame that fails is dropped
+static void batch_flush(int fd, struct packet_batch *b)
+{
+	int sent = 0;
+	while (sent < b->n) {
+		int n = sendmmsg(fd, b->msgs + sent, b->n - sent, 0);
+		if (n < 0) {
+			perror("Send raw packet failed");
+			n = 1;
+		}
+		sent += n;
+	}
+	b->n = 0;
+}
+
+void iface_send_packet(iface_info_t *iface, const char *packet, int len)
+{
+	// with a send ring the frame is copied into it, and sent with the batch
+	if (iface->ring && ring_send(iface, packet, len) == 0) {
+		if (!batching)
+			ring_flush(iface);
+		return;
+	}
+
+	struct packet_batch *b = batching && len <= ETH_FRAME_LEN ? iface_batch(iface) : NULL;
+	if (!b) {
+		iface_send_now(iface, packet, len);
+		return;
+	}
+
+	int i = b->n++;
+	memcpy(b->frames[i], packet, len);
+	fill_addr(&b->addrs[i], iface, packet);
+	b->iovs[i].iov_base = b->frames[i];
+	b->iovs[i].iov_len = len;
+	memset(&b->msgs[i], 0, sizeof(struct mmsghdr));
+	b->msgs[i].msg_hdr.msg_name = &b->addrs[i];
+	b->msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_ll);
+	b->msgs[i].msg_hdr.msg_iov = &b->iovs[i];
+	b->msgs[i].msg_hdr.msg_iovlen = 1;
+
+	if (b->n == PACKET_BATCH)
+		batch_flush(iface->fd, b);
+}
+
+void packet_batch_begin()
+{
+	batching = 1;
+}
+
+void packet_batch_end()
+{
+	for (int fd = 0; fd < nbatches; fd++) {
+		if (batches[fd] && batches[fd]->n > 0)
+			batch_flush(fd, batches[fd]);
+	}
+
+	iface_info_t *iface = NULL;
+	list_for_each_entry(iface, &instance->iface_list, list) {
+		if (iface->ring)
+			ring_flush(iface);
+	}
+	batching = 0;
+}
+
 //broadcast packet to all iface except the source one
 void broadcast_packet(iface_info_t *iface, const char *packet, int len)
 {
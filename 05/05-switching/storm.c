@@ -0,0 +1,202 @@
+#include "storm.h"
+#include "log.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+#define NSEC_PER_SEC 1000000000ULL
+
+static const char *storm_class_names[STORM_CLASSES] = {
+	"broadcast", "multicast", "unknown"
+};
+
+// the limits of every port, per class
+static struct {
+	u64 pps, bps;
+} storm_limits[STORM_CLASSES];
+
+static u64 now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+int storm_parse(const char *arg)
+{
+	const char *eq = strchr(arg, '=');
+	if (!eq)
+		return -1;
+
+	int first = -1, last = -1;
+	int len = eq - arg;
+	if (len == 3 && strncmp(arg, "all", 3) == 0) {
+		first = 0;
+		last = STORM_CLASSES - 1;
+	}
+	for (int c = 0; c < STORM_CLASSES; c++) {
+		if (strlen(storm_class_names[c]) == len && strncmp(arg, storm_class_names[c], len) == 0)
+			first = last = c;
+	}
+	if (first < 0)
+		return -1;
+
+	char *end;
+	u64 pps = strtoull(eq + 1, &end, 10), bps = 0;
+	if (end == eq + 1)
+		return -1;
+	if (*end == ',') {
+		const char *p = end + 1;
+		bps = strtoull(p, &end, 10);
+		if (end == p)
+			return -1;
+	}
+	if (*end)
+		return -1;
+
+	for (int c = first; c <= last; c++) {
+		storm_limits[c].pps = pps;
+		storm_limits[c].bps = bps;
+	}
+	return 0;
+}
+
+// only the receiving thread of the port counts, but the counters are read
+// by others
+static void storm_count(u64 *counter)
+{
+	__atomic_store_n(counter, *counter + 1, __ATOMIC_RELAXED);
+}
+
+// fill a bucket for elapsed ns, but not beyond its burst
+static u64 storm_fill(u64 tokens, u64 rate, u64 elapsed, u64 burst)
+{
+	tokens += rate * elapsed;
+	return tokens < burst ? tokens : burst;
+}
+
+int storm_admit(iface_info_t *iface, const u8 dhost[ETH_ALEN], int len)
+{
+	if (!iface->storm)
+		return 1;
+
+	enum storm_class class = STORM_UNKNOWN;
+	if (dhost[0] & 1) {
+		static const u8 broadcast[ETH_ALEN] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
+		class = memcmp(dhost, broadcast, ETH_ALEN) == 0 ? STORM_BROADCAST : STORM_MULTICAST;
+	}
+
+	struct storm_policer *p = &iface->storm->policers[class];
+	if (p->pps == 0 && p->bps == 0) {
+		storm_count(&p->passed);
+		return 1;
+	}
+
+	// the buckets are full again after STORM_BURST_MS, longer waits need
+	// not be counted, nor overflow
+	u64 now = now_ns();
+	u64 elapsed = now - p->last;
+	if (elapsed > STORM_BURST_MS * 1000000ULL)
+		elapsed = STORM_BURST_MS * 1000000ULL;
+	p->last = now;
+	p->frame_tokens = storm_fill(p->frame_tokens, p->pps, elapsed, p->frame_burst);
+	p->byte_tokens = storm_fill(p->byte_tokens, p->bps / 8, elapsed, p->byte_burst);
+
+	u64 frame_cost = p->pps ? NSEC_PER_SEC : 0;
+	u64 byte_cost = p->bps ? len * NSEC_PER_SEC : 0;
+	if (p->frame_tokens < frame_cost || p->byte_tokens < byte_cost) {
+		storm_count(&p->dropped);
+		return 0;
+	}
+
+	p->frame_tokens -= frame_cost;
+	p->byte_tokens -= byte_cost;
+	storm_count(&p->passed);
+	return 1;
+}
+
+void storm_dump(FILE *fp)
+{
+	iface_info_t *iface = NULL;
+	list_for_each_entry(iface, &instance->iface_list, list) {
+		if (!iface->storm)
+			continue;
+
+		fprintf(fp, "storm control on %s:", iface->name);
+		for (int c = 0; c < STORM_CLASSES; c++) {
+			struct storm_policer *p = &iface->storm->policers[c];
+			fprintf(fp, " %s %lu passed %lu dropped%s", storm_class_names[c], \
+					(unsigned long)__atomic_load_n(&p->passed, __ATOMIC_RELAXED), \
+					(unsigned long)__atomic_load_n(&p->dropped, __ATOMIC_RELAXED), \
+					c + 1 < STORM_CLASSES ? "," : ".\n");
+		}
+	}
+}
+
+// a bucket of rate holds at least one unit of cost, or nothing would pass
+static u64 storm_burst(u64 rate, u64 cost)
+{
+	u64 burst = rate * STORM_BURST_MS * 1000000ULL;
+	return burst > cost * NSEC_PER_SEC ? burst : cost * NSEC_PER_SEC;
+}
+
+static void *storm_report_thread(void *nil)
+{
+	while (1) {
+		sleep(STORM_REPORT_INTERVAL);
+
+		iface_info_t *iface = NULL;
+		list_for_each_entry(iface, &instance->iface_list, list) {
+			struct storm_policer *p = iface->storm->policers;
+			u64 dropped[STORM_CLASSES];
+			int changed = 0;
+			for (int c = 0; c < STORM_CLASSES; c++) {
+				dropped[c] = __atomic_load_n(&p[c].dropped, __ATOMIC_RELAXED);
+				changed |= dropped[c] != p[c].reported;
+				p[c].reported = dropped[c];
+			}
+			if (changed)
+				log(INFO, "storm control on %s dropped %lu broadcast, %lu multicast, " \
+						"%lu unknown unicast frames.", iface->name, \
+						(unsigned long)dropped[STORM_BROADCAST], \
+						(unsigned long)dropped[STORM_MULTICAST], \
+						(unsigned long)dropped[STORM_UNKNOWN]);
+		}
+	}
+
+	return NULL;
+}
+
+void init_storm_control()
+{
+	int limited = 0;
+	for (int c = 0; c < STORM_CLASSES; c++)
+		limited |= storm_limits[c].pps || storm_limits[c].bps;
+	if (!limited)
+		return;
+
+	u64 now = now_ns();
+	iface_info_t *iface = NULL;
+	list_for_each_entry(iface, &instance->iface_list, list) {
+		iface->storm = calloc(1, sizeof(struct storm_control));
+		if (!iface->storm) {
+			log(ERROR, "could not allocate the storm control of %s.", iface->name);
+			exit(1);
+		}
+		for (int c = 0; c < STORM_CLASSES; c++) {
+			struct storm_policer *p = &iface->storm->policers[c];
+			p->pps = storm_limits[c].pps;
+			p->bps = storm_limits[c].bps;
+			p->frame_burst = p->frame_tokens = storm_burst(p->pps, 1);
+			p->byte_burst = p->byte_tokens = storm_burst(p->bps / 8, ETH_FRAME_LEN);
+			p->last = now;
+		}
+	}
+
+	pthread_t tid;
+	if (pthread_create(&tid, NULL, storm_report_thread, NULL) == 0)
+		pthread_detach(tid);
+}
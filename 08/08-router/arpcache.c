@@ -21,7 +21,7 @@ void arpcache_init()
 
 	init_list_head(&(arpcache.req_list));
 
-	pthread_mutex_init(&arpcache.lock, NULL);
+	pthread_rwlock_init(&arpcache.lock, NULL);
 
 	pthread_create(&arpcache.thread, NULL, arpcache_sweep, NULL);
 }
@@ -29,7 +29,7 @@ void arpcache_init()
 // release all the resources when exiting
 void arpcache_destroy()
 {
-	pthread_mutex_lock(&arpcache.lock);
+	pthread_rwlock_wrlock(&arpcache.lock);
 
 	struct arp_req *req_entry = NULL, *req_q;
 	list_for_each_entry_safe(req_entry, req_q, &(arpcache.req_list), list) {
@@ -46,7 +46,7 @@ void arpcache_destroy()
 
 	pthread_kill(arpcache.thread, SIGTERM);
 
-	pthread_mutex_unlock(&arpcache.lock);
+	pthread_rwlock_unlock(&arpcache.lock);
 }
 
 // lookup the IP->mac mapping
@@ -56,18 +56,18 @@ void arpcache_destroy()
 int arpcache_lookup(u32 ip4, u8 mac[ETH_ALEN])
 {
 
-	pthread_mutex_lock(&arpcache.lock);
+	pthread_rwlock_rdlock(&arpcache.lock);
 
 
 	if(arpcache.entries[ip4%32].ip4 == ip4){
 		for(int i = 0; i < ETH_ALEN; i++){
 			mac[i] = arpcache.entries[ip4%32].mac[i];
 		}
-		pthread_mutex_unlock(&arpcache.lock);
+		pthread_rwlock_unlock(&arpcache.lock);
 		return 1;
 	}
 
-	pthread_mutex_unlock(&arpcache.lock);
+	pthread_rwlock_unlock(&arpcache.lock);
 
 		
 	return 0;
@@ -82,7 +82,7 @@ int arpcache_lookup(u32 ip4, u8 mac[ETH_ALEN])
 // with the given IP address and iface, append the packet, and send arp request.
 void arpcache_append_packet(iface_info_t *iface, u32 ip4, char *packet, int len)
 {
-	pthread_mutex_lock(&arpcache.lock);
+	pthread_rwlock_wrlock(&arpcache.lock);
 
 	//if corresponding arpcache entry exists, find req
 	struct arp_req * req = (struct arp_req *)(&arpcache.req_list);	
@@ -122,7 +122,7 @@ void arpcache_append_packet(iface_info_t *iface, u32 ip4, char *packet, int len)
 	req->retries += 1;
 	arp_send_request(iface, ip4);
 
-	pthread_mutex_unlock(&arpcache.lock);
+	pthread_rwlock_unlock(&arpcache.lock);
 
 		
 }
@@ -132,7 +132,7 @@ void arpcache_append_packet(iface_info_t *iface, u32 ip4, char *packet, int len)
 // them out
 void arpcache_insert(u32 ip4, u8 mac[ETH_ALEN])
 {
-	pthread_mutex_lock(&arpcache.lock);
+	pthread_rwlock_wrlock(&arpcache.lock);
 
 	arpcache.entries[ip4%32].ip4 = ip4;
 	for(int i = 0; i < ETH_ALEN; i++){
@@ -141,23 +141,30 @@ void arpcache_insert(u32 ip4, u8 mac[ETH_ALEN])
 	arpcache.entries[ip4%32].added = time(NULL);
 	arpcache.entries[ip4%32].valid = 1;
 
+	// the requests answered are taken off the list, and their packets sent
+	// once the lock is released, another thread may answer them meanwhile
 	struct arp_req * req;
 	struct cached_pkt * pkt;
 	struct arp_req * l;
+	struct list_head answered;
+	init_list_head(&answered);
 	list_for_each_entry_safe(req, l, &arpcache.req_list, list){
 		if(req->ip4 == ip4){
-			list_for_each_entry(pkt, (struct list_head *)&req->cached_packets, list){
-				pthread_mutex_unlock(&arpcache.lock);
-				iface_send_packet_by_arp(req->iface, ip4, pkt->packet, pkt->len);
-				pthread_mutex_lock(&arpcache.lock);
-			}
-			delete_list(&req->cached_packets, struct cached_pkt, list);
 			list_delete_entry((struct list_head *)req);
-			free(req);
+			list_add_tail((struct list_head *)req, &answered);
 		}
 	}
 	
-	pthread_mutex_unlock(&arpcache.lock);
+	pthread_rwlock_unlock(&arpcache.lock);
+
+	list_for_each_entry_safe(req, l, &answered, list){
+		list_for_each_entry(pkt, (struct list_head *)&req->cached_packets, list){
+			iface_send_packet_by_arp(req->iface, ip4, pkt->packet, pkt->len);
+		}
+		delete_list(&req->cached_packets, struct cached_pkt, list);
+		list_delete_entry((struct list_head *)req);
+		free(req);
+	}
 }
 
 // sweep arpcache periodically
@@ -174,16 +181,20 @@ void *arpcache_sweep(void *arg)
 	u32 tmp;
 	while (1) {
 		sleep(1);
-		pthread_mutex_lock(&arpcache.lock);
+		pthread_rwlock_wrlock(&arpcache.lock);
 		for(int i = 0; i < 32; i++){
 			if((time(NULL) - arpcache.entries[i].added) > 15 && arpcache.entries[i].valid){
 				 arpcache.entries[i].valid = 0;
 			}
 		}
 
+		// the requests given up on are taken off the list, and answered with
+		// icmp once the lock is released
 		struct arp_req * req;
 		struct cached_pkt * pkt;
 		struct arp_req * l;
+		struct list_head failed;
+		init_list_head(&failed);
 		list_for_each_entry_safe(req, l, &arpcache.req_list, list){
 			if(time(NULL) - req->sent > 1){
 				if(req->retries < 5){				
@@ -191,33 +202,36 @@ void *arpcache_sweep(void *arg)
 					arp_send_request(req->iface, req->ip4);
 				}
 				else{
-					list_for_each_entry(pkt, (struct list_head *)&req->cached_packets, list){
-						pthread_mutex_unlock(&arpcache.lock);
-						struct iphdr * ip = packet_to_ip_hdr(pkt->packet);
-						
-						//make up IP Header info of ICMP packet
-						char * packet_buf = (char * )malloc(ETHER_HDR_SIZE + ntohs(ip->tot_len) + 40);
-						memset(packet_buf, 0, ETHER_HDR_SIZE*sizeof(char));
-						memcpy(packet_buf + ETHER_HDR_SIZE*sizeof(char), pkt->packet + ETHER_HDR_SIZE, ntohs(ip->tot_len));
-						memcpy(packet_buf + ETHER_HDR_SIZE*sizeof(char) + ip->ihl*4 + 8, pkt->packet + ETHER_HDR_SIZE, ip->ihl*4 + 8);
-						ip = packet_to_ip_hdr(packet_buf);
-						tmp = ip->daddr;
-						ip->ttl = DEFAULT_TTL;
-						ip->daddr = ip->saddr;
-						ip->saddr = tmp;
-						ip->tot_len = htons(ip->ihl*4 + 8 + ip->ihl*4 + 8);
-						ip->checksum = ip_checksum(ip);
-						icmp_send_packet(packet_buf, ETHER_HDR_SIZE + ntohs(ip->tot_len), 0x03, 0x01);
-						pthread_mutex_lock(&arpcache.lock);
-					}	
-					delete_list(&req->cached_packets, struct cached_pkt, list);
 					list_delete_entry((struct list_head *)req);
-					free(req);
+					list_add_tail((struct list_head *)req, &failed);
 				}
 			}
 		}
 
-		pthread_mutex_unlock(&arpcache.lock);
+		pthread_rwlock_unlock(&arpcache.lock);
+
+		list_for_each_entry_safe(req, l, &failed, list){
+			list_for_each_entry(pkt, (struct list_head *)&req->cached_packets, list){
+				struct iphdr * ip = packet_to_ip_hdr(pkt->packet);
+				
+				//make up IP Header info of ICMP packet
+				char * packet_buf = (char * )malloc(ETHER_HDR_SIZE + ntohs(ip->tot_len) + 40);
+				memset(packet_buf, 0, ETHER_HDR_SIZE*sizeof(char));
+				memcpy(packet_buf + ETHER_HDR_SIZE*sizeof(char), pkt->packet + ETHER_HDR_SIZE, ntohs(ip->tot_len));
+				memcpy(packet_buf + ETHER_HDR_SIZE*sizeof(char) + ip->ihl*4 + 8, pkt->packet + ETHER_HDR_SIZE, ip->ihl*4 + 8);
+				ip = packet_to_ip_hdr(packet_buf);
+				tmp = ip->daddr;
+				ip->ttl = DEFAULT_TTL;
+				ip->daddr = ip->saddr;
+				ip->saddr = tmp;
+				ip->tot_len = htons(ip->ihl*4 + 8 + ip->ihl*4 + 8);
+				ip->checksum = ip_checksum(ip);
+				icmp_send_packet(packet_buf, ETHER_HDR_SIZE + ntohs(ip->tot_len), 0x03, 0x01);
+			}	
+			delete_list(&req->cached_packets, struct cached_pkt, list);
+			list_delete_entry((struct list_head *)req);
+			free(req);
+		}
 	}
 
 	return NULL;
@@ -33,10 +33,12 @@ struct arp_cache_entry {
 	int valid;
 };
 
+// looked up by every receiving thread at once, only inserting, queueing
+// packets and sweeping take the lock exclusively
 typedef struct {
 	struct arp_cache_entry entries[MAX_ARP_SIZE];
 	struct list_head req_list;
-	pthread_mutex_t lock;
+	pthread_rwlock_t lock;
 	pthread_t thread;
 } arpcache_t;
 
@@ -25,6 +25,13 @@ typedef struct {
 	u32 mask;
 	char name[16];
 	char ip_str[16];
+
+	// PACKET_MMAP rings, NULL if the socket copies frames, see ring.c
+	struct packet_ring *ring;
+
+	// AF_XDP socket receiving the frames instead of fd, NULL if none, see
+	// xsk.c
+	struct xsk_socket *xsk;
 } iface_info_t;
 
 #endif
@@ -5,4 +5,15 @@
 
 void iface_send_packet(iface_info_t *iface, char *packet, int len);
 
+// frames received with one recvmmsg, and queued at most on an interface
+// before they are sent with one sendmmsg
+#define PACKET_BATCH 32
+
+// while the frames of a receive batch are handled, the frames sent on this
+// thread are queued per interface, and sent by packet_batch_end or as soon
+// as PACKET_BATCH of them are queued on one interface. Frames sent by other
+// threads go out right away.
+void packet_batch_begin();
+void packet_batch_end();
+
 #endif
@@ -20,6 +20,8 @@ typedef struct {
 	iface_info_t *iface;	// pointer to the interface structure
 } rt_entry_t;
 
+// the table is loaded before the stack runs and only read afterwards, so
+// the receiving threads look it up without a lock
 extern struct list_head rtable;
 
 void init_rtable();
@@ -0,0 +1,53 @@
+#ifndef __XSK_H__
+#define __XSK_H__
+
+#include "base.h"
+
+#include <pthread.h>
+
+// AF_XDP socket of an interface: an XDP program attached in generic mode,
+// so that it works on any driver (veth included), redirects every frame
+// received on queue 0 to the socket. Frames live in UMEM, a region shared
+// with the kernel and split into XSK_FRAME_SIZE frames, which are handed
+// back and forth through four rings: the kernel receives into the frames
+// of the fill ring and passes them on in the rx ring, and sends the frames
+// of the tx ring and passes them back in the completion ring.
+#define XSK_FRAME_SIZE 2048
+#define XSK_NUM_FRAMES 4096
+#define XSK_RING_SIZE 1024		// of each ring, a power of 2
+
+// a ring shared with the kernel, the indexes run freely and are masked
+struct xsk_ring {
+	u32 *producer, *consumer;
+	void *descs;
+	u32 mask;
+	void *map;
+	size_t map_len;
+};
+
+struct xsk_socket {
+	int fd;
+	int map_fd, prog_fd, link_fd;	// the xskmap and the program redirecting to it
+	char *umem;
+	struct xsk_ring fill, comp, rx, tx;
+	u64 free_frames[XSK_NUM_FRAMES];	// frames in none of the rings
+	int nfree;
+	int tx_pending;				// frames in the tx ring the kernel was not told of
+	pthread_mutex_t tx_lock;	// any thread may send
+};
+
+// set up the AF_XDP socket of iface and redirect the frames it receives to
+// it. Returns -1 and leaves iface as it was if the kernel does not support
+// it, frames are received by iface->fd then.
+int xsk_open(iface_info_t *iface);
+
+// hand the frames in the rx ring to handle, the frame points into UMEM and
+// is only valid until handle returns
+int xsk_recv(iface_info_t *iface, void (*handle)(iface_info_t *iface, char *packet, int len));
+
+// copy a frame into a UMEM frame on the tx ring, it is sent by xsk_flush.
+// Returns -1 if the frame does not fit or no frame is free.
+int xsk_send(iface_info_t *iface, const char *packet, int len);
+void xsk_flush(iface_info_t *iface);
+
+#endif
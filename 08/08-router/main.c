@@ -1,9 +1,14 @@
+#define _GNU_SOURCE		// recvmmsg, pthread_setaffinity_np
+
 #include "base.h"
 #include "ether.h"
 #include "arp.h"
 #include "arpcache.h"
 #include "ip.h"
 #include "rtable.h"
+#include "packet.h"
+#include "ring.h"
+#include "xsk.h"
 
 #include "log.h"
 
@@ -11,6 +16,9 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <poll.h>
+#include <sched.h>
+#include <time.h>
+#include <pthread.h>
 #include <net/if.h>
 #include <ifaddrs.h>
 #include <sys/ioctl.h>
@@ -20,13 +28,45 @@
 
 ustack_t *instance;
 
-static iface_info_t *fd_to_iface(int fd)
+// whether frames are received and sent through PACKET_MMAP rings
+static int use_ring;
+
+// whether frames are received and sent through AF_XDP sockets
+static int use_xsk;
+
+// whether every interface is received on by a thread of its own, and the
+// cpus these threads are pinned to, in turn
+static int use_threads;
+static int *rx_cpus;
+static int rx_ncpus;
+
+// how long receiving busy polls after the last frame, in us, 0 if it
+// always sleeps in poll
+static long busy_poll_us;
+
+// the receiving loops report how they spent their time this often, in s,
+// when busy polling
+#define RX_REPORT_INTERVAL 10
+
+// the interface of each socket, indexed by fd
+static iface_info_t **fd_ifaces;
+static int fd_ifaces_len;
+
+static void map_fd_to_iface(int fd, iface_info_t *iface)
 {
-	iface_info_t *iface = NULL;
-	list_for_each_entry(iface, &instance->iface_list, list) {
-		if (iface->fd == fd)
-			return iface;
+	if (fd >= fd_ifaces_len) {
+		int n = fd + 1;
+		fd_ifaces = realloc(fd_ifaces, n * sizeof(*fd_ifaces));
+		bzero(fd_ifaces + fd_ifaces_len, (n - fd_ifaces_len) * sizeof(*fd_ifaces));
+		fd_ifaces_len = n;
 	}
+	fd_ifaces[fd] = iface;
+}
+
+static iface_info_t *fd_to_iface(int fd)
+{
+	if (fd >= 0 && fd < fd_ifaces_len && fd_ifaces[fd])
+		return fd_ifaces[fd];
 
 	fprintf(stderr, "Could not find the desired interface "
 			"according to fd '%d'\n", fd);
@@ -184,6 +224,15 @@ void init_all_ifaces()
 	int i = 0;
 	list_for_each_entry(iface, &instance->iface_list, list) {
 		int fd = read_iface_info(iface);
+		// the socket keeps copying frames if the rings or the AF_XDP socket
+		// could not be set up
+		map_fd_to_iface(fd, iface);
+		if (use_xsk && xsk_open(iface) == 0) {
+			fd = iface->xsk->fd;
+			map_fd_to_iface(fd, iface);
+		}
+		else if (use_ring)
+			ring_open(iface);
 		instance->fds[i].fd = fd;
 		instance->fds[i].events |= POLLIN;
 
@@ -205,15 +254,224 @@ void init_ustack()
 	load_rtable_from_kernel();
 }
 
+// a frame of the rx ring or of UMEM is only valid until the handler returns, while
+// the handlers own the packets they are given
+static void handle_ring_packet(iface_info_t *iface, char *frame, int len)
+{
+	char *packet = malloc(len);
+	if (!packet)
+		return;
+	memcpy(packet, frame, len);
+	handle_packet(iface, packet, len);
+}
+
+// the buffers a thread receives frames into, PACKET_BATCH at a time with
+// one recvmmsg
+struct rx_batch {
+	char bufs[PACKET_BATCH][ETH_FRAME_LEN];
+	struct sockaddr_ll addrs[PACKET_BATCH];
+	struct iovec iovs[PACKET_BATCH];
+	struct mmsghdr msgs[PACKET_BATCH];
+};
+
+static void init_rx_batch(struct rx_batch *rx)
+{
+	bzero(rx->msgs, sizeof(rx->msgs));
+	for (int j = 0; j < PACKET_BATCH; j++) {
+		rx->iovs[j].iov_base = rx->bufs[j];
+		rx->iovs[j].iov_len = ETH_FRAME_LEN;
+		rx->msgs[j].msg_hdr.msg_name = &rx->addrs[j];
+		rx->msgs[j].msg_hdr.msg_iov = &rx->iovs[j];
+		rx->msgs[j].msg_hdr.msg_iovlen = 1;
+	}
+}
+
+// handle the frames ready on iface, the frames sent while handling them go
+// out together
+static void iface_recv(iface_info_t *iface, struct rx_batch *rx)
+{
+	if (iface->ring || iface->xsk) {
+		packet_batch_begin();
+		if (iface->xsk)
+			xsk_recv(iface, handle_ring_packet);
+		else
+			ring_recv(iface, handle_ring_packet);
+		packet_batch_end();
+		return;
+	}
+
+	for (int j = 0; j < PACKET_BATCH; j++)
+		rx->msgs[j].msg_hdr.msg_namelen = sizeof(struct sockaddr_ll);
+	int n = recvmmsg(iface->fd, rx->msgs, PACKET_BATCH, MSG_DONTWAIT, NULL);
+	if (n < 0) {
+		if (errno != EAGAIN && errno != EINTR)
+			log(ERROR, "receive packet error: %s", strerror(errno));
+		return;
+	}
+
+	packet_batch_begin();
+	for (int j = 0; j < n; j++) {
+		int len = rx->msgs[j].msg_len;
+		if (rx->addrs[j].sll_pkttype == PACKET_OUTGOING) {
+			// XXX: Linux raw socket will capture both incoming and
+			// outgoing packets, we only care about the incoming ones.
+		}
+		else if (len > 0) {
+			char *packet = malloc(len);
+			if (!packet)
+				continue;
+			memcpy(packet, rx->bufs[j], len);
+			handle_packet(iface, packet, len);
+		}
+	}
+	packet_batch_end();
+}
+
+// a receiving loop, busy polling or not, and how it spent its time in ns
+struct rx_poller {
+	const char *name;
+	u64 mark;				// when it last waited for frames or returned
+	u64 last_ready;			// when frames were last ready
+	u64 spin_ns, sleep_ns, work_ns;
+	u64 spin_wakeups, sleep_wakeups;
+	u64 last_report;
+};
+
+static u64 now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void rx_report(struct rx_poller *p, u64 now)
+{
+	u64 total = p->spin_ns + p->sleep_ns + p->work_ns;
+	if (total == 0)
+		return;
+	log(INFO, "%s: spinning %.1f%%, sleeping %.1f%%, handling frames %.1f%% of the time, "
+			"%lu wakeups from spinning, %lu from sleeping", p->name,
+			p->spin_ns * 100.0 / total, p->sleep_ns * 100.0 / total,
+			p->work_ns * 100.0 / total, (unsigned long)p->spin_wakeups,
+			(unsigned long)p->sleep_wakeups);
+	p->spin_ns = p->sleep_ns = p->work_ns = 0;
+	p->spin_wakeups = p->sleep_wakeups = 0;
+	p->last_report = now;
+}
+
+// wait until frames are ready on fds. While traffic flows the sockets are
+// polled without sleeping, which saves the wakeup latency, and once they
+// have been idle for busy_poll_us the thread sleeps in poll again.
+static int rx_poll(struct pollfd *fds, int nfds, struct rx_poller *p)
+{
+	u64 start = now_ns();
+	if (p->mark == 0)
+		p->mark = p->last_report = start;
+	p->work_ns += start - p->mark;
+
+	int ready = 0;
+	u64 now = start;
+	while (busy_poll_us > 0 && now - p->last_ready < busy_poll_us * 1000ULL) {
+		ready = poll(fds, nfds, 0);
+		now = now_ns();
+		if (ready != 0)
+			break;
+		// the other receiving threads and the kernel go first if they
+		// share the cpu
+		sched_yield();
+	}
+	p->spin_ns += now - start;
+
+	if (ready > 0)
+		p->spin_wakeups += 1;
+	else if (ready == 0) {
+		ready = poll(fds, nfds, -1);
+		u64 woken = now_ns();
+		p->sleep_ns += woken - now;
+		now = woken;
+		if (ready > 0)
+			p->sleep_wakeups += 1;
+	}
+
+	if (ready > 0)
+		p->last_ready = now;
+	p->mark = now;
+	if (busy_poll_us > 0 && now - p->last_report >= RX_REPORT_INTERVAL * 1000000000ULL)
+		rx_report(p, now);
+	return ready;
+}
+
+struct rx_thread {
+	pthread_t tid;
+	struct pollfd pfd;
+};
+
+static void *rx_thread(void *arg)
+{
+	struct rx_thread *t = arg;
+	iface_info_t *iface = fd_to_iface(t->pfd.fd);
+	struct rx_batch *rx = malloc(sizeof(struct rx_batch));
+	if (!iface || !rx) {
+		log(ERROR, "could not start receiving on fd %d", t->pfd.fd);
+		return NULL;
+	}
+	init_rx_batch(rx);
+
+	struct rx_poller poller = { .name = iface->name };
+	while (1) {
+		int ready = rx_poll(&t->pfd, 1, &poller);
+		if (ready < 0 && errno != EINTR) {
+			perror("Poll failed!");
+			break;
+		}
+		if (ready > 0 && (t->pfd.revents & POLLIN))
+			iface_recv(iface, rx);
+	}
+
+	free(rx);
+	return NULL;
+}
+
+// receive on every interface in a thread of its own, so that forwarding
+// scales with the cpus
+static void ustack_run_threads()
+{
+	struct rx_thread *threads = calloc(instance->nifs, sizeof(struct rx_thread));
+	for (int i = 0; i < instance->nifs; i++) {
+		threads[i].pfd = instance->fds[i];
+		if (pthread_create(&threads[i].tid, NULL, rx_thread, &threads[i]) != 0) {
+			log(ERROR, "creating the receiving thread %d failed", i);
+			exit(1);
+		}
+
+		if (rx_ncpus > 0) {
+			cpu_set_t set;
+			CPU_ZERO(&set);
+			CPU_SET(rx_cpus[i % rx_ncpus], &set);
+			if (pthread_setaffinity_np(threads[i].tid, sizeof(set), &set) != 0)
+				log(ERROR, "pinning the receiving thread %d to cpu %d failed", i,
+						rx_cpus[i % rx_ncpus]);
+		}
+	}
+
+	for (int i = 0; i < instance->nifs; i++)
+		pthread_join(threads[i].tid, NULL);
+	free(threads);
+}
+
 void ustack_run()
 {
-	struct sockaddr_ll addr;
-	socklen_t addr_len = sizeof(addr);
-	char buf[ETH_FRAME_LEN];
-	int len;
+	if (use_threads) {
+		ustack_run_threads();
+		return;
+	}
 
+	static struct rx_batch rx;
+	init_rx_batch(&rx);
+
+	struct rx_poller poller = { .name = "all interfaces" };
 	while (1) {
-		int ready = poll(instance->fds, instance->nifs, -1);
+		int ready = rx_poll(instance->fds, instance->nifs, &poller);
 		if (ready < 0) {
 			perror("Poll failed!");
 			break;
@@ -222,32 +480,31 @@ void ustack_run()
 			continue;
 
 		for (int i = 0; i < instance->nifs; i++) {
-			if (instance->fds[i].revents & POLLIN) {
-				len = recvfrom(instance->fds[i].fd, buf, ETH_FRAME_LEN, 0, \
-						(struct sockaddr*)&addr, &addr_len);
-				if (len <= 0) {
-					log(ERROR, "receive packet error: %s", strerror(errno));
-				}
-				else if (addr.sll_pkttype == PACKET_OUTGOING) {
-					// XXX: Linux raw socket will capture both incoming and
-					// outgoing packets, we only care about the incoming ones.
-
-					// log(DEBUG, "received packet which is sent from the "
-					// 		"interface itself, drop it.");
-				}
-				else {
-					iface_info_t *iface = fd_to_iface(instance->fds[i].fd);
-					char *packet = malloc(len);
-					if (!packet)
-						continue;
-					memcpy(packet, buf, len);
-					handle_packet(iface, packet, len);
-				}
-			}
+			if (!(instance->fds[i].revents & POLLIN))
+				continue;
+
+			iface_info_t *iface = fd_to_iface(instance->fds[i].fd);
+			iface_recv(iface, &rx);
 		}
 	}
 }
 
+// the cpus of a list like 0,2,3, returns -1 if it is not one
+static int parse_cpus(const char *list)
+{
+	rx_ncpus = 0;
+	for (const char *p = list; *p; ) {
+		char *end;
+		long cpu = strtol(p, &end, 10);
+		if (end == p || cpu < 0 || cpu >= CPU_SETSIZE || (*end && *end != ','))
+			return -1;
+		rx_cpus = realloc(rx_cpus, (rx_ncpus + 1) * sizeof(int));
+		rx_cpus[rx_ncpus++] = cpu;
+		p = *end ? end + 1 : end;
+	}
+	return rx_ncpus > 0 ? 0 : -1;
+}
+
 int main(int argc, const char **argv)
 {
 	if (getuid() && geteuid()) {
@@ -255,6 +512,41 @@ int main(int argc, const char **argv)
 		exit(1);
 	}
 
+	// -r: receive and send through PACKET_MMAP rings
+	// -x: receive and send through AF_XDP sockets
+	// -t: receive on every interface in a thread of its own
+	// -c: pin these threads to a list of cpus, in turn
+	// -b: busy poll for this many us after the last frame
+	int opt;
+	while ((opt = getopt(argc, (char **)argv, "rxtc:b:")) != -1) {
+		switch (opt) {
+			case 'r':
+				use_ring = 1;
+				break;
+			case 'x':
+				use_xsk = 1;
+				break;
+			case 't':
+				use_threads = 1;
+				break;
+			case 'b':
+				busy_poll_us = atol(optarg);
+				break;
+			case 'c':
+				use_threads = 1;
+				if (parse_cpus(optarg) == 0)
+					break;
+				// fall through
+			default:
+				fprintf(stderr, "Usage: %s [-r|-x] [-t] [-c cpu,...] [-b us]\n", argv[0]);
+				exit(1);
+		}
+	}
+	if (optind < argc) {
+		fprintf(stderr, "Usage: %s [-r|-x] [-t] [-c cpu,...] [-b us]\n", argv[0]);
+		exit(1);
+	}
+
 	init_ustack();
 	ustack_run();
 
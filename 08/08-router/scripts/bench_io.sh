@@ -0,0 +1,83 @@
+#!/bin/bash
+
+# Compare the I/O backends of the router: h1 floods UDP datagrams to h2
+# through the router, once per backend, and the datagrams h2 received are
+# counted. The topology is that of router_topo.py, in network namespaces.
+#
+# usage: scripts/bench_io.sh [datagrams], as root in the router directory
+
+COUNT=${1:-300000}
+BACKENDS=("" "-r" "-x")
+
+for n in h1 h2 h3 r1; do
+	ip netns del $n 2>/dev/null
+	ip netns add $n
+	ip -n $n link set lo up
+done
+
+for i in 1 2 3; do
+	ip link add h$i-eth0 netns h$i type veth peer name r1-eth$((i-1)) netns r1
+	ip -n h$i addr add 10.0.$i.$((i*11))/24 dev h$i-eth0
+	ip -n h$i link set h$i-eth0 up
+	ip -n h$i route add default via 10.0.$i.1
+	ip -n r1 addr add 10.0.$i.1/24 dev r1-eth$((i-1))
+	ip -n r1 link set r1-eth$((i-1)) up
+done
+
+# the router answers arp and forwards, not the kernel
+ip netns exec r1 sysctl -qw net.ipv4.ip_forward=0 net.ipv4.conf.all.arp_ignore=8 \
+	net.ipv4.icmp_echo_ignore_all=1
+
+# raw UDP with a zero checksum, so that checksum offload does not matter
+SEND='
+import socket, sys, time
+s = socket.socket(socket.AF_INET, socket.SOCK_RAW, socket.IPPROTO_UDP)
+pkt = bytes.fromhex("23292328006c0000") + b"x" * 100
+start = time.time()
+for i in range(int(sys.argv[2])):
+	s.sendto(pkt, (sys.argv[1], 0))
+print(time.time() - start)
+'
+RECV='
+import socket
+s = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+s.bind(("0.0.0.0", 9000))
+s.settimeout(2)
+n = 0
+try:
+	while True:
+		s.recv(2048)
+		n += 1
+except socket.timeout:
+	pass
+print(n)
+'
+
+for b in "${BACKENDS[@]}"; do
+	ip netns exec r1 ./router $b > /dev/null 2>&1 &
+	router=$!
+	sleep 1
+
+	# the first datagrams only resolve the address of h2
+	ip netns exec h1 python3 -c "$SEND" 10.0.2.22 10 > /dev/null
+	sleep 0.5
+
+	ip netns exec h2 python3 -c "$RECV" > /tmp/bench_io.$$ &
+	recv=$!
+	sleep 0.3
+	secs=$(ip netns exec h1 python3 -c "$SEND" 10.0.2.22 $COUNT)
+	wait $recv
+
+	received=$(cat /tmp/bench_io.$$)
+	awk -v b="$b" -v n=$COUNT -v t=$secs -v r=$received 'BEGIN {
+		printf "router %-3s sent %d in %.2fs, received %d (%d/s)\n", b, n, t, r, r / t
+	}'
+
+	kill $router
+	wait $router 2>/dev/null
+done
+
+rm -f /tmp/bench_io.$$
+for n in h1 h2 h3 r1; do
+	ip netns del $n
+done
@@ -0,0 +1,313 @@
+#include "xsk.h"
+#include "log.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/bpf.h>
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+#include <linux/if_packet.h>
+
+// in copy mode the kernel sends at most this many frames per send call
+#define XSK_TX_BUDGET 32
+
+// received frames go back to the fill ring this many at a time, the kernel
+// drops what arrives while it is empty
+#define XSK_FILL_BATCH 64
+
+static int sys_bpf(int cmd, union bpf_attr *attr)
+{
+	return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+// the xskmap, the sockets by queue, only queue 0 has one
+static int xsk_create_map()
+{
+	union bpf_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.map_type = BPF_MAP_TYPE_XSKMAP;
+	attr.key_size = sizeof(u32);
+	attr.value_size = sizeof(u32);
+	attr.max_entries = 1;
+	return sys_bpf(BPF_MAP_CREATE, &attr);
+}
+
+static int xsk_update_map(int map_fd, u32 queue, int fd)
+{
+	u32 value = fd;
+	union bpf_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.map_fd = map_fd;
+	attr.key = (u64)(uintptr_t)&queue;
+	attr.value = (u64)(uintptr_t)&value;
+	attr.flags = BPF_ANY;
+	return sys_bpf(BPF_MAP_UPDATE_ELEM, &attr);
+}
+
+// return bpf_redirect_map(&xskmap, ctx->rx_queue_index, XDP_PASS), there
+// is no libbpf to build it from C
+static int xsk_load_prog(int map_fd)
+{
+	struct bpf_insn insns[] = {
+		// r2 = ctx->rx_queue_index
+		{ .code = BPF_LDX | BPF_MEM | BPF_W, .dst_reg = BPF_REG_2, .src_reg = BPF_REG_1,
+			.off = offsetof(struct xdp_md, rx_queue_index) },
+		// r1 = the xskmap, a load of two instructions
+		{ .code = BPF_LD | BPF_DW | BPF_IMM, .dst_reg = BPF_REG_1,
+			.src_reg = BPF_PSEUDO_MAP_FD, .imm = map_fd },
+		{ 0 },
+		// r3 = what becomes of a frame whose queue has no socket
+		{ .code = BPF_ALU64 | BPF_MOV | BPF_K, .dst_reg = BPF_REG_3, .imm = XDP_PASS },
+		{ .code = BPF_JMP | BPF_CALL, .imm = BPF_FUNC_redirect_map },
+		{ .code = BPF_JMP | BPF_EXIT },
+	};
+
+	union bpf_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.prog_type = BPF_PROG_TYPE_XDP;
+	attr.expected_attach_type = BPF_XDP;
+	attr.insns = (u64)(uintptr_t)insns;
+	attr.insn_cnt = sizeof(insns) / sizeof(insns[0]);
+	attr.license = (u64)(uintptr_t)"GPL";
+	return sys_bpf(BPF_PROG_LOAD, &attr);
+}
+
+// attach the program in generic mode, it is detached once the link is
+// closed, when the router exits at the latest
+static int xsk_attach_prog(int prog_fd, int ifindex)
+{
+	union bpf_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.link_create.prog_fd = prog_fd;
+	attr.link_create.target_ifindex = ifindex;
+	attr.link_create.attach_type = BPF_XDP;
+	attr.link_create.flags = XDP_FLAGS_SKB_MODE;
+	return sys_bpf(BPF_LINK_CREATE, &attr);
+}
+
+static int xsk_map_ring(struct xsk_ring *r, int fd, off_t pgoff,
+		const struct xdp_ring_offset *off, size_t desc_size)
+{
+	r->map_len = off->desc + XSK_RING_SIZE * desc_size;
+	r->map = mmap(NULL, r->map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			fd, pgoff);
+	if (r->map == MAP_FAILED) {
+		r->map = NULL;
+		return -1;
+	}
+
+	r->producer = (u32 *)((char *)r->map + off->producer);
+	r->consumer = (u32 *)((char *)r->map + off->consumer);
+	r->descs = (char *)r->map + off->desc;
+	r->mask = XSK_RING_SIZE - 1;
+	return 0;
+}
+
+// undo what xsk_open did so far
+static void xsk_free(struct xsk_socket *x)
+{
+	if (x->link_fd >= 0)
+		close(x->link_fd);
+	if (x->prog_fd >= 0)
+		close(x->prog_fd);
+	if (x->map_fd >= 0)
+		close(x->map_fd);
+
+	struct xsk_ring *rings[] = { &x->fill, &x->comp, &x->rx, &x->tx };
+	for (int i = 0; i < 4; i++)
+		if (rings[i]->map)
+			munmap(rings[i]->map, rings[i]->map_len);
+	if (x->fd >= 0)
+		close(x->fd);
+	if (x->umem != MAP_FAILED)
+		munmap(x->umem, (size_t)XSK_NUM_FRAMES * XSK_FRAME_SIZE);
+	free(x);
+}
+
+int xsk_open(iface_info_t *iface)
+{
+	struct xsk_socket *x = calloc(1, sizeof(struct xsk_socket));
+	if (!x)
+		return -1;
+	x->fd = x->map_fd = x->prog_fd = x->link_fd = -1;
+	pthread_mutex_init(&x->tx_lock, NULL);
+
+	x->umem = mmap(NULL, (size_t)XSK_NUM_FRAMES * XSK_FRAME_SIZE, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+	x->fd = socket(AF_XDP, SOCK_RAW, 0);
+	if (x->umem == MAP_FAILED || x->fd < 0) {
+		log(ERROR, "creating the AF_XDP socket of %s failed: %s", iface->name, strerror(errno));
+		xsk_free(x);
+		return -1;
+	}
+
+	struct xdp_umem_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.addr = (u64)(uintptr_t)x->umem;
+	reg.len = (u64)XSK_NUM_FRAMES * XSK_FRAME_SIZE;
+	reg.chunk_size = XSK_FRAME_SIZE;
+
+	int size = XSK_RING_SIZE;
+	struct xdp_mmap_offsets off;
+	socklen_t optlen = sizeof(off);
+	if (setsockopt(x->fd, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg)) < 0 ||
+			setsockopt(x->fd, SOL_XDP, XDP_UMEM_FILL_RING, &size, sizeof(size)) < 0 ||
+			setsockopt(x->fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &size, sizeof(size)) < 0 ||
+			setsockopt(x->fd, SOL_XDP, XDP_RX_RING, &size, sizeof(size)) < 0 ||
+			setsockopt(x->fd, SOL_XDP, XDP_TX_RING, &size, sizeof(size)) < 0 ||
+			getsockopt(x->fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &optlen) < 0 ||
+			xsk_map_ring(&x->fill, x->fd, XDP_UMEM_PGOFF_FILL_RING, &off.fr, sizeof(u64)) < 0 ||
+			xsk_map_ring(&x->comp, x->fd, XDP_UMEM_PGOFF_COMPLETION_RING, &off.cr, sizeof(u64)) < 0 ||
+			xsk_map_ring(&x->rx, x->fd, XDP_PGOFF_RX_RING, &off.rx, sizeof(struct xdp_desc)) < 0 ||
+			xsk_map_ring(&x->tx, x->fd, XDP_PGOFF_TX_RING, &off.tx, sizeof(struct xdp_desc)) < 0) {
+		log(ERROR, "setting up the UMEM of %s failed: %s", iface->name, strerror(errno));
+		xsk_free(x);
+		return -1;
+	}
+
+	// the kernel receives into the first frames, the others are for sending
+	u64 *fill = x->fill.descs;
+	for (int i = 0; i < XSK_RING_SIZE; i++)
+		fill[i] = (u64)i * XSK_FRAME_SIZE;
+	__atomic_store_n(x->fill.producer, XSK_RING_SIZE, __ATOMIC_RELEASE);
+	for (int i = XSK_RING_SIZE; i < XSK_NUM_FRAMES; i++)
+		x->free_frames[x->nfree++] = (u64)i * XSK_FRAME_SIZE;
+
+	// generic mode copies frames in and out of UMEM
+	struct sockaddr_xdp sxdp;
+	memset(&sxdp, 0, sizeof(sxdp));
+	sxdp.sxdp_family = AF_XDP;
+	sxdp.sxdp_ifindex = iface->index;
+	sxdp.sxdp_queue_id = 0;
+	sxdp.sxdp_flags = XDP_COPY;
+	if (bind(x->fd, (struct sockaddr *)&sxdp, sizeof(sxdp)) < 0) {
+		log(ERROR, "binding the AF_XDP socket of %s failed: %s", iface->name, strerror(errno));
+		xsk_free(x);
+		return -1;
+	}
+
+	x->map_fd = xsk_create_map();
+	if (x->map_fd < 0 || xsk_update_map(x->map_fd, 0, x->fd) < 0 ||
+			(x->prog_fd = xsk_load_prog(x->map_fd)) < 0 ||
+			(x->link_fd = xsk_attach_prog(x->prog_fd, iface->index)) < 0) {
+		log(ERROR, "attaching the XDP program to %s failed: %s", iface->name, strerror(errno));
+		xsk_free(x);
+		return -1;
+	}
+
+#ifdef PACKET_IGNORE_OUTGOING
+	// iface->fd only sends from now on, what it sends is not queued on it
+	int on = 1;
+	setsockopt(iface->fd, SOL_PACKET, PACKET_IGNORE_OUTGOING, &on, sizeof(on));
+#endif
+
+	iface->xsk = x;
+	return 0;
+}
+
+int xsk_recv(iface_info_t *iface, void (*handle)(iface_info_t *iface, char *packet, int len))
+{
+	struct xsk_socket *x = iface->xsk;
+	struct xdp_desc *descs = x->rx.descs;
+	u64 *fill = x->fill.descs;
+
+	u32 cons = *x->rx.consumer;
+	u32 prod = __atomic_load_n(x->rx.producer, __ATOMIC_ACQUIRE);
+	u32 fill_prod = *x->fill.producer;
+	int n = 0;
+	for (; cons != prod; cons++, n++) {
+		struct xdp_desc *d = &descs[cons & x->rx.mask];
+		handle(iface, x->umem + d->addr, d->len);
+		// the frame goes back to the kernel to receive into, there is room
+		// since it was taken from the fill ring
+		fill[fill_prod++ & x->fill.mask] = d->addr & ~(u64)(XSK_FRAME_SIZE - 1);
+		if ((n + 1) % XSK_FILL_BATCH == 0) {
+			__atomic_store_n(x->rx.consumer, cons + 1, __ATOMIC_RELEASE);
+			__atomic_store_n(x->fill.producer, fill_prod, __ATOMIC_RELEASE);
+		}
+	}
+
+	__atomic_store_n(x->rx.consumer, cons, __ATOMIC_RELEASE);
+	__atomic_store_n(x->fill.producer, fill_prod, __ATOMIC_RELEASE);
+	return n;
+}
+
+// the frames the kernel sent are free again, called with tx_lock held
+static void xsk_reclaim(struct xsk_socket *x)
+{
+	u64 *addrs = x->comp.descs;
+	u32 cons = *x->comp.consumer;
+	u32 prod = __atomic_load_n(x->comp.producer, __ATOMIC_ACQUIRE);
+	for (; cons != prod; cons++)
+		x->free_frames[x->nfree++] = addrs[cons & x->comp.mask];
+	__atomic_store_n(x->comp.consumer, cons, __ATOMIC_RELEASE);
+}
+
+// have the kernel send the tx ring, called with tx_lock held
+static void xsk_kick(struct xsk_socket *x)
+{
+	// EAGAIN once the budget of a call is used up, while frames are left
+	for (int i = 0; i <= XSK_RING_SIZE / XSK_TX_BUDGET; i++) {
+		if (__atomic_load_n(x->tx.consumer, __ATOMIC_ACQUIRE) == *x->tx.producer)
+			break;
+		if (sendto(x->fd, NULL, 0, MSG_DONTWAIT, NULL, 0) < 0 && errno != EAGAIN) {
+			if (errno != EBUSY && errno != ENOBUFS)
+				perror("Send raw packet failed");
+			break;
+		}
+	}
+	x->tx_pending = 0;
+	xsk_reclaim(x);
+}
+
+static int xsk_tx_full(struct xsk_socket *x)
+{
+	return x->nfree == 0 ||
+		*x->tx.producer - __atomic_load_n(x->tx.consumer, __ATOMIC_ACQUIRE) > x->tx.mask;
+}
+
+int xsk_send(iface_info_t *iface, const char *packet, int len)
+{
+	struct xsk_socket *x = iface->xsk;
+	if (len > XSK_FRAME_SIZE)
+		return -1;
+
+	pthread_mutex_lock(&x->tx_lock);
+	xsk_reclaim(x);
+	if (xsk_tx_full(x)) {
+		xsk_kick(x);
+		if (xsk_tx_full(x)) {
+			pthread_mutex_unlock(&x->tx_lock);
+			return -1;
+		}
+	}
+
+	u64 addr = x->free_frames[--x->nfree];
+	memcpy(x->umem + addr, packet, len);
+
+	u32 prod = *x->tx.producer;
+	struct xdp_desc *d = &((struct xdp_desc *)x->tx.descs)[prod & x->tx.mask];
+	d->addr = addr;
+	d->len = len;
+	d->options = 0;
+	__atomic_store_n(x->tx.producer, prod + 1, __ATOMIC_RELEASE);
+	x->tx_pending += 1;
+	pthread_mutex_unlock(&x->tx_lock);
+	return 0;
+}
+
+void xsk_flush(iface_info_t *iface)
+{
+	struct xsk_socket *x = iface->xsk;
+
+	pthread_mutex_lock(&x->tx_lock);
+	if (x->tx_pending > 0)
+		xsk_kick(x);
+	pthread_mutex_unlock(&x->tx_lock);
+}
@@ -27,6 +27,8 @@ typedef struct {
 	u32 mask;					// ip mask of this interface
 	char name[16];				// name of this interface
 	char ip_str[16];			// string of the ip address
+	struct packet_ring *ring;	// PACKET_MMAP rings, NULL if the socket
+								// copies frames
 } iface_info_t;
 
 #endif
@@ -0,0 +1,42 @@
+#ifndef __RING_H__
+#define __RING_H__
+
+#include "base.h"
+
+#include <pthread.h>
+
+// PACKET_MMAP rings of an interface: received frames are read in place from
+// blocks the kernel hands over whole (TPACKET_V3), and frames to send are
+// copied into the slots of a second ring (TPACKET_V2), sent by the kernel
+// with one send call
+#define RING_BLOCK_SIZE (1 << 16)
+#define RING_RX_BLOCK_NR 64
+#define RING_TX_FRAME_NR 256
+#define RING_FRAME_SIZE 2048
+
+// a block is handed over once full, or this many ms after its first frame
+#define RING_RX_TIMEOUT 1
+
+struct packet_ring {
+	int tx_fd;					// sends only, the rx ring is on iface->fd
+	char *rx_map, *tx_map;
+	int rx_block;				// the next block to read
+	int tx_frame;				// the next slot to fill
+	int tx_pending;				// slots filled but not sent yet
+	pthread_mutex_t tx_lock;	// any thread may send
+};
+
+// set up the rings of iface, whose socket is bound already. Returns -1 and
+// leaves the socket as it was if the kernel does not support them.
+int ring_open(iface_info_t *iface);
+
+// hand every frame of the blocks the kernel filled to handle, the frame
+// points into the ring and is only valid until handle returns
+int ring_recv(iface_info_t *iface, void (*handle)(iface_info_t *iface, char *packet, int len));
+
+// copy a frame into the send ring, it is sent by ring_flush or once the
+// ring is full. Returns -1 if the frame does not fit.
+int ring_send(iface_info_t *iface, const char *packet, int len);
+void ring_flush(iface_info_t *iface);
+
+#endif
@@ -1,9 +1,13 @@
+#define _GNU_SOURCE		// recvmmsg
+
 #include "base.h"
 #include "ether.h"
 #include "arp.h"
 #include "arpcache.h"
 #include "ip.h"
 #include "rtable.h"
+#include "packet.h"
+#include "ring.h"
 #include "tcp_sock.h"
 #include "tcp_apps.h"
 
@@ -22,6 +26,9 @@
 
 ustack_t *instance;
 
+// whether frames are received and sent through PACKET_MMAP rings
+static int use_ring;
+
 static iface_info_t *fd_to_iface(int fd)
 {
 	iface_info_t *iface = NULL;
@@ -185,6 +192,9 @@ void init_all_ifaces()
 	int i = 0;
 	list_for_each_entry(iface, &instance->iface_list, list) {
 		int fd = read_iface_info(iface);
+		// the socket keeps copying frames if the rings could not be set up
+		if (use_ring)
+			ring_open(iface);
 		instance->fds[i].fd = fd;
 		instance->fds[i].events |= POLLIN;
 
@@ -210,12 +220,34 @@ void init_ustack()
 	init_tcp_stack();
 }
 
+// a frame of the rx ring is only valid until the handler returns, while
+// the handlers own the packets they are given
+static void handle_ring_packet(iface_info_t *iface, char *frame, int len)
+{
+	char *packet = malloc(len);
+	if (!packet)
+		return;
+	memcpy(packet, frame, len);
+	handle_packet(iface, packet, len);
+}
+
 void ustack_run()
 {
-	struct sockaddr_ll addr;
-	socklen_t addr_len = sizeof(addr);
-	char buf[ETH_FRAME_LEN];
-	int len;
+	// frames are received PACKET_BATCH at a time, with one recvmmsg per
+	// interface ready
+	static char bufs[PACKET_BATCH][ETH_FRAME_LEN];
+	struct sockaddr_ll addrs[PACKET_BATCH];
+	struct iovec iovs[PACKET_BATCH];
+	struct mmsghdr msgs[PACKET_BATCH];
+
+	bzero(msgs, sizeof(msgs));
+	for (int j = 0; j < PACKET_BATCH; j++) {
+		iovs[j].iov_base = bufs[j];
+		iovs[j].iov_len = ETH_FRAME_LEN;
+		msgs[j].msg_hdr.msg_name = &addrs[j];
+		msgs[j].msg_hdr.msg_iov = &iovs[j];
+		msgs[j].msg_hdr.msg_iovlen = 1;
+	}
 
 	while (1) {
 		int ready = poll(instance->fds, instance->nifs, -1);
@@ -227,30 +259,45 @@ void ustack_run()
 			continue;
 
 		for (int i = 0; i < instance->nifs; i++) {
-			if (instance->fds[i].revents & POLLIN) {
-				len = recvfrom(instance->fds[i].fd, buf, ETH_FRAME_LEN, 0, \
-						(struct sockaddr*)&addr, &addr_len);
-				if (len <= 0) {
+			if (!(instance->fds[i].revents & POLLIN))
+				continue;
+
+			// the frames sent while handling the batch go out together
+			iface_info_t *iface = fd_to_iface(instance->fds[i].fd);
+			if (iface->ring) {
+				packet_batch_begin();
+				ring_recv(iface, handle_ring_packet);
+				packet_batch_end();
+				continue;
+			}
+
+			for (int j = 0; j < PACKET_BATCH; j++)
+				msgs[j].msg_hdr.msg_namelen = sizeof(struct sockaddr_ll);
+			int n = recvmmsg(instance->fds[i].fd, msgs, PACKET_BATCH, MSG_DONTWAIT, NULL);
+			if (n < 0) {
+				if (errno != EAGAIN && errno != EINTR)
 					log(ERROR, "receive packet error: %s", strerror(errno));
-				}
-				else if (addr.sll_pkttype == PACKET_OUTGOING) {
+				continue;
+			}
+
+			packet_batch_begin();
+			for (int j = 0; j < n; j++) {
+				int len = msgs[j].msg_len;
+				if (addrs[j].sll_pkttype == PACKET_OUTGOING) {
 					// XXX: Linux raw socket will capture both incoming and
 					// outgoing packets, we only care about the incoming ones.
-
-					// log(DEBUG, "received packet which is sent from the "
-					// 		"interface itself, drop it.");
 				}
-				else {
-					iface_info_t *iface = fd_to_iface(instance->fds[i].fd);
+				else if (len > 0) {
 					char *packet = malloc(len);
 					if (!packet) {
 						log(ERROR, "malloc failed when receiving packet.");
 						continue;
 					}
-					memcpy(packet, buf, len);
+					memcpy(packet, bufs[j], len);
 					handle_packet(iface, packet, len);
 				}
 			}
+			packet_batch_end();
 		}
 	}
 }
@@ -258,8 +305,9 @@ void ustack_run()
 static void usage_and_exit(const char *basename)
 {
 	fprintf(stderr, "Usage: \n");
-	fprintf(stderr, "\t%s server local_port\n", basename);
-	fprintf(stderr, "\t%s client remote_ip remote_port\n", basename);
+	fprintf(stderr, "\t%s [-r] server local_port\n", basename);
+	fprintf(stderr, "\t%s [-r] client remote_ip remote_port\n", basename);
+	fprintf(stderr, "-r: receive and send through PACKET_MMAP rings\n");
 
 	exit(1);
 }
@@ -296,13 +344,18 @@ int main(int argc, char **argv)
 		exit(1);
 	}
 
-	if (argc < 2) {
+	int first = 1;
+	if (argc > 1 && strcmp(argv[1], "-r") == 0) {
+		use_ring = 1;
+		first = 2;
+	}
+	if (argc <= first) {
 		usage_and_exit(argv[0]);
 	}
 
 	init_ustack();
 
-	run_application(basename(argv[0]), argv+1, argc-1);
+	run_application(basename(argv[0]), argv+first, argc-first);
 
 	ustack_run();
 
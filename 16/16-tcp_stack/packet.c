@@ -1,4 +1,7 @@
+#define _GNU_SOURCE		// sendmmsg
+
 #include "packet.h"
+#include "ring.h"
 #include "types.h"
 #include "ether.h"
 
@@ -7,33 +10,134 @@
 #include <assert.h>
 #include <string.h>
 #include <arpa/inet.h>
+#include <sys/socket.h>
 #include <linux/if_packet.h>
 
 extern ustack_t *instance;
 
+// frames queued on a socket, owned by the batch until they are sent
+struct packet_batch {
+	int n;
+	struct mmsghdr msgs[PACKET_BATCH];
+	struct iovec iovs[PACKET_BATCH];
+	struct sockaddr_ll addrs[PACKET_BATCH];
+	char *frames[PACKET_BATCH];
+};
+
+// the frames sent on this thread while batching, a queue per socket
+static __thread int batching;
+static __thread struct packet_batch **batches;
+static __thread int nbatches;
+
+// the queue of the socket of iface, NULL if it could not be allocated
+static struct packet_batch *iface_batch(iface_info_t *iface)
+{
+	if (iface->fd >= nbatches) {
+		int n = iface->fd + 1;
+		struct packet_batch **grown = realloc(batches, n * sizeof(*batches));
+		if (!grown)
+			return NULL;
+		memset(grown + nbatches, 0, (n - nbatches) * sizeof(*batches));
+		batches = grown;
+		nbatches = n;
+	}
+	if (!batches[iface->fd])
+		batches[iface->fd] = calloc(1, sizeof(struct packet_batch));
+	return batches[iface->fd];
+}
+
+static void fill_addr(struct sockaddr_ll *addr, iface_info_t *iface, const char *packet)
+{
+	memset(addr, 0, sizeof(struct sockaddr_ll));
+	addr->sll_family = AF_PACKET;
+	addr->sll_ifindex = iface->index;
+	addr->sll_halen = ETH_ALEN;
+	addr->sll_protocol = htons(ETH_P_ARP);
+	struct ether_header *eh = (struct ether_header *)packet;
+	memcpy(addr->sll_addr, eh->ether_dhost, ETH_ALEN);
+}
+
 void _iface_send_packet(iface_info_t *iface, char *packet, int len)
 {
 	struct sockaddr_ll addr;
-	memset(&addr, 0, sizeof(struct sockaddr_ll));
-	addr.sll_family = AF_PACKET;
-	addr.sll_ifindex = iface->index;
-	addr.sll_halen = ETH_ALEN;
-	addr.sll_protocol = htons(ETH_P_ARP);
-	struct ether_header *eh = (struct ether_header *)packet;
-	memcpy(addr.sll_addr, eh->ether_dhost, ETH_ALEN);
+	fill_addr(&addr, iface, packet);
 
 	if (sendto(iface->fd, packet, len, 0, (const struct sockaddr *)&addr,
 				sizeof(struct sockaddr_ll)) < 0) {
  		perror("Send raw packet failed");
 	}
 }
+// send the frames queued on socket fd, a frame that fails is dropped
+static void batch_flush(int fd, struct packet_batch *b)
+{
+	int sent = 0;
+	while (sent < b->n) {
+		int n = sendmmsg(fd, b->msgs + sent, b->n - sent, 0);
+		if (n < 0) {
+			perror("Send raw packet failed");
+			n = 1;
+		}
+		sent += n;
+	}
+
+	for (int i = 0; i < b->n; i++)
+		free(b->frames[i]);
+	b->n = 0;
+}
 
 void iface_send_packet(iface_info_t *iface, char *packet, int len)
 {
-	_iface_send_packet(iface, packet, len);
-	free(packet);
+	// with a send ring the frame is copied into it, and sent with the batch
+	if (iface->ring && ring_send(iface, packet, len) == 0) {
+		if (!batching)
+			ring_flush(iface);
+		free(packet);
+		return;
+	}
+
+	struct packet_batch *b = batching ? iface_batch(iface) : NULL;
+	if (!b) {
+		_iface_send_packet(iface, packet, len);
+		free(packet);
+		return;
+	}
+
+	int i = b->n++;
+	b->frames[i] = packet;
+	fill_addr(&b->addrs[i], iface, packet);
+	b->iovs[i].iov_base = packet;
+	b->iovs[i].iov_len = len;
+	memset(&b->msgs[i], 0, sizeof(struct mmsghdr));
+	b->msgs[i].msg_hdr.msg_name = &b->addrs[i];
+	b->msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_ll);
+	b->msgs[i].msg_hdr.msg_iov = &b->iovs[i];
+	b->msgs[i].msg_hdr.msg_iovlen = 1;
+
+	if (b->n == PACKET_BATCH)
+		batch_flush(iface->fd, b);
+}
+
+void packet_batch_begin()
+{
+	batching = 1;
+}
+
+void packet_batch_end()
+{
+	for (int fd = 0; fd < nbatches; fd++) {
+		if (batches[fd] && batches[fd]->n > 0)
+			batch_flush(fd, batches[fd]);
+	}
+
+	iface_info_t *iface = NULL;
+	list_for_each_entry(iface, &instance->iface_list, list) {
+		if (iface->ring)
+			ring_flush(iface);
+	}
+	batching = 0;
 }
 
+// every interface gets a copy, as the batch of each frees its frames
 void broadcast_packet(iface_info_t *in_iface, char *packet, int len)
 {
 	iface_info_t *iface = NULL;
@@ -41,7 +145,11 @@ void broadcast_packet(iface_info_t *in_iface, char *packet, int len)
 		if (iface->index == in_iface->index)
 			continue;
 
-		_iface_send_packet(iface, packet, len);
+		char *copy = malloc(len);
+		if (!copy)
+			continue;
+		memcpy(copy, packet, len);
+		iface_send_packet(iface, copy, len);
 	}
 
 	free(packet);
@@ -0,0 +1,172 @@
+#include "ring.h"
+#include "log.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <linux/if_packet.h>
+
+#define RING_RX_LEN ((size_t)RING_BLOCK_SIZE * RING_RX_BLOCK_NR)
+#define RING_TX_LEN ((size_t)RING_FRAME_SIZE * RING_TX_FRAME_NR)
+
+// where the frame starts in a send slot
+#define RING_TX_DATA (TPACKET2_HDRLEN - sizeof(struct sockaddr_ll))
+
+// undo what ring_open did so far, the socket of iface goes back to copying
+static void ring_free(iface_info_t *iface, struct packet_ring *r)
+{
+	struct tpacket_req3 none;
+	memset(&none, 0, sizeof(none));
+
+	if (r->rx_map != MAP_FAILED)
+		munmap(r->rx_map, RING_RX_LEN);
+	setsockopt(iface->fd, SOL_PACKET, PACKET_RX_RING, &none, sizeof(none));
+	if (r->tx_map != MAP_FAILED)
+		munmap(r->tx_map, RING_TX_LEN);
+	if (r->tx_fd >= 0)
+		close(r->tx_fd);
+	free(r);
+}
+
+int ring_open(iface_info_t *iface)
+{
+	struct packet_ring *r = calloc(1, sizeof(struct packet_ring));
+	if (!r)
+		return -1;
+	r->tx_fd = -1;
+	r->rx_map = r->tx_map = MAP_FAILED;
+	pthread_mutex_init(&r->tx_lock, NULL);
+
+	// the rx ring, blocks of frames of any size
+	int version = TPACKET_V3;
+	struct tpacket_req3 rx_req;
+	memset(&rx_req, 0, sizeof(rx_req));
+	rx_req.tp_block_size = RING_BLOCK_SIZE;
+	rx_req.tp_block_nr = RING_RX_BLOCK_NR;
+	rx_req.tp_frame_size = RING_FRAME_SIZE;
+	rx_req.tp_frame_nr = RING_RX_LEN / RING_FRAME_SIZE;
+	rx_req.tp_retire_blk_tov = RING_RX_TIMEOUT;
+	if (setsockopt(iface->fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0 ||
+			setsockopt(iface->fd, SOL_PACKET, PACKET_RX_RING, &rx_req, sizeof(rx_req)) < 0) {
+		log(ERROR, "setting up the rx ring of %s failed: %s", iface->name, strerror(errno));
+		ring_free(iface, r);
+		return -1;
+	}
+	r->rx_map = mmap(NULL, RING_RX_LEN, PROT_READ | PROT_WRITE, MAP_SHARED, iface->fd, 0);
+	if (r->rx_map == MAP_FAILED) {
+		log(ERROR, "mapping the rx ring of %s failed: %s", iface->name, strerror(errno));
+		ring_free(iface, r);
+		return -1;
+	}
+
+#ifdef PACKET_IGNORE_OUTGOING
+	// what this stack sends is not copied into the rx ring, where supported
+	int on = 1;
+	setsockopt(iface->fd, SOL_PACKET, PACKET_IGNORE_OUTGOING, &on, sizeof(on));
+#endif
+
+	// the tx ring, on a socket bound to no protocol so that it receives
+	// nothing
+	version = TPACKET_V2;
+	struct tpacket_req tx_req;
+	memset(&tx_req, 0, sizeof(tx_req));
+	tx_req.tp_block_size = RING_BLOCK_SIZE;
+	tx_req.tp_block_nr = RING_TX_LEN / RING_BLOCK_SIZE;
+	tx_req.tp_frame_size = RING_FRAME_SIZE;
+	tx_req.tp_frame_nr = RING_TX_FRAME_NR;
+
+	struct sockaddr_ll sll;
+	memset(&sll, 0, sizeof(sll));
+	sll.sll_family = AF_PACKET;
+	sll.sll_ifindex = iface->index;
+
+	r->tx_fd = socket(AF_PACKET, SOCK_RAW, 0);
+	if (r->tx_fd < 0 ||
+			setsockopt(r->tx_fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0 ||
+			setsockopt(r->tx_fd, SOL_PACKET, PACKET_TX_RING, &tx_req, sizeof(tx_req)) < 0 ||
+			bind(r->tx_fd, (struct sockaddr *)&sll, sizeof(sll)) < 0 ||
+			(r->tx_map = mmap(NULL, RING_TX_LEN, PROT_READ | PROT_WRITE, MAP_SHARED,
+							  r->tx_fd, 0)) == MAP_FAILED) {
+		log(ERROR, "setting up the tx ring of %s failed: %s", iface->name, strerror(errno));
+		ring_free(iface, r);
+		return -1;
+	}
+
+	iface->ring = r;
+	return 0;
+}
+
+int ring_recv(iface_info_t *iface, void (*handle)(iface_info_t *iface, char *packet, int len))
+{
+	struct packet_ring *r = iface->ring;
+	int n = 0;
+
+	// at most one lap, so the other interfaces get their turn
+	for (int b = 0; b < RING_RX_BLOCK_NR; b++) {
+		struct tpacket_block_desc *bd =
+			(void *)(r->rx_map + (size_t)r->rx_block * RING_BLOCK_SIZE);
+		if (!(__atomic_load_n(&bd->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER))
+			break;
+
+		struct tpacket3_hdr *h = (void *)((char *)bd + bd->hdr.bh1.offset_to_first_pkt);
+		for (u32 i = 0; i < bd->hdr.bh1.num_pkts; i++) {
+			struct sockaddr_ll *addr =
+				(void *)((char *)h + TPACKET_ALIGN(sizeof(struct tpacket3_hdr)));
+			// XXX: Linux raw socket will capture both incoming and
+			// outgoing packets, while we only care about the incoming ones.
+			if (addr->sll_pkttype != PACKET_OUTGOING)
+				handle(iface, (char *)h + h->tp_mac, h->tp_snaplen);
+			h = (void *)((char *)h + h->tp_next_offset);
+			n += 1;
+		}
+
+		// the block goes back to the kernel
+		__atomic_store_n(&bd->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+		r->rx_block = (r->rx_block + 1) % RING_RX_BLOCK_NR;
+	}
+
+	return n;
+}
+
+int ring_send(iface_info_t *iface, const char *packet, int len)
+{
+	struct packet_ring *r = iface->ring;
+	if (len > RING_FRAME_SIZE - RING_TX_DATA)
+		return -1;
+
+	pthread_mutex_lock(&r->tx_lock);
+	struct tpacket2_hdr *h = (void *)(r->tx_map + (size_t)r->tx_frame * RING_FRAME_SIZE);
+	int busy = TP_STATUS_SEND_REQUEST | TP_STATUS_SENDING;
+	if (__atomic_load_n(&h->tp_status, __ATOMIC_ACQUIRE) & busy) {
+		// the ring is full, wait until the kernel sent what is in it
+		if (send(r->tx_fd, NULL, 0, 0) < 0)
+			perror("Send raw packet failed");
+		r->tx_pending = 0;
+		if (__atomic_load_n(&h->tp_status, __ATOMIC_ACQUIRE) & busy) {
+			pthread_mutex_unlock(&r->tx_lock);
+			return -1;
+		}
+	}
+
+	memcpy((char *)h + RING_TX_DATA, packet, len);
+	h->tp_len = len;
+	__atomic_store_n(&h->tp_status, TP_STATUS_SEND_REQUEST, __ATOMIC_RELEASE);
+	r->tx_frame = (r->tx_frame + 1) % RING_TX_FRAME_NR;
+	r->tx_pending += 1;
+	pthread_mutex_unlock(&r->tx_lock);
+	return 0;
+}
+
+void ring_flush(iface_info_t *iface)
+{
+	struct packet_ring *r = iface->ring;
+
+	pthread_mutex_lock(&r->tx_lock);
+	if (r->tx_pending > 0 && send(r->tx_fd, NULL, 0, MSG_DONTWAIT) < 0 && errno != EAGAIN)
+		perror("Send raw packet failed");
+	r->tx_pending = 0;
+	pthread_mutex_unlock(&r->tx_lock);
+}